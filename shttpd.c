@@ -30,18 +30,32 @@ static const int debug = 0;
 static const int debug = 1;
 #endif
 
+/* 64-bit off_t even on 32-bit platforms, so files over 2GB work */
+#define _FILE_OFFSET_BITS 64
+
 #ifdef __linux
 #define _GNU_SOURCE /* for strsignal() and vasprintf() */
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
 #endif
 
 #ifdef __sun__
 #include <sys/sendfile.h>
 #endif
 
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/param.h>
@@ -54,6 +68,7 @@ static const int debug = 1;
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -63,14 +78,30 @@ static const int debug = 1;
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifndef min
 #define min(a,b) ( ((a)<(b)) ? (a) : (b) )
 #endif
 
+#ifndef max
+#define max(a,b) ( ((a)>(b)) ? (a) : (b) )
+#endif
+
 #ifndef INADDR_NONE
 #define INADDR_NONE -1
 #endif
 
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
 #if defined(O_EXCL) && !defined(O_EXLOCK)
 #define O_EXLOCK O_EXCL
 #endif
@@ -120,101 +151,230 @@ warn(const char *format, ...)
    fprintf(stderr, ": %s\n", strerror(errno));
    va_end(va);
 }
+
+/* warnx - warn without the strerror */
+static void
+warnx(const char *format, ...)
+{
+   va_list va;
+
+   va_start(va, format);
+   fprintf(stderr, "warning: ");
+   vfprintf(stderr, format, va);
+   fprintf(stderr, "\n");
+   va_end(va);
+}
 #endif
 
 /* ---------------------------------------------------------------------------
- * LIST_* macros taken from FreeBSD's src/sys/sys/queue.h,v 1.56
+ * TAILQ_* macros taken from FreeBSD's src/sys/sys/queue.h,v 1.56
  * Copyright (c) 1991, 1993
  *      The Regents of the University of California.  All rights reserved.
  *
  * Under a BSD license.
  */
-#define LIST_HEAD(name, type)                                           \
+#define TAILQ_HEAD(name, type)                                          \
 struct name {                                                           \
-        struct type *lh_first;  /* first element */                     \
+        struct type *tqh_first; /* first element */                     \
+        struct type **tqh_last; /* addr of last next element */         \
 }
 
-#define LIST_HEAD_INITIALIZER(head)                                     \
-        { NULL }
-
-#define LIST_ENTRY(type)                                                \
+#define TAILQ_ENTRY(type)                                               \
 struct {                                                                \
-        struct type *le_next;   /* next element */                      \
-        struct type **le_prev;  /* address of previous next element */  \
+        struct type *tqe_next;  /* next element */                      \
+        struct type **tqe_prev; /* address of previous next element */  \
 }
 
-#define LIST_FIRST(head)        ((head)->lh_first)
-
-#define LIST_FOREACH(var, head, field)                                  \
-        for ((var) = LIST_FIRST((head));                                \
-            (var);                                                      \
-            (var) = LIST_NEXT((var), field))
+#define TAILQ_FIRST(head)       ((head)->tqh_first)
+#define TAILQ_EMPTY(head)       ((head)->tqh_first == NULL)
 
-#define LIST_FOREACH_SAFE(var, head, field, tvar)                       \
-    for ((var) = LIST_FIRST((head));                                    \
-        (var) && ((tvar) = LIST_NEXT((var), field), 1);                 \
-        (var) = (tvar))
+#define TAILQ_FOREACH_SAFE(var, head, field, tvar)                      \
+        for ((var) = TAILQ_FIRST((head));                               \
+            (var) && ((tvar) = TAILQ_NEXT((var), field), 1);            \
+            (var) = (tvar))
 
-#define LIST_INIT(head) do {                                            \
-        LIST_FIRST((head)) = NULL;                                      \
+#define TAILQ_INIT(head) do {                                           \
+        TAILQ_FIRST((head)) = NULL;                                     \
+        (head)->tqh_last = &TAILQ_FIRST((head));                        \
 } while (0)
 
-#define LIST_INSERT_HEAD(head, elm, field) do {                         \
-        if ((LIST_NEXT((elm), field) = LIST_FIRST((head))) != NULL)     \
-                LIST_FIRST((head))->field.le_prev = &LIST_NEXT((elm), field);\
-        LIST_FIRST((head)) = (elm);                                     \
-        (elm)->field.le_prev = &LIST_FIRST((head));                     \
+#define TAILQ_INSERT_TAIL(head, elm, field) do {                        \
+        TAILQ_NEXT((elm), field) = NULL;                                \
+        (elm)->field.tqe_prev = (head)->tqh_last;                       \
+        *(head)->tqh_last = (elm);                                      \
+        (head)->tqh_last = &TAILQ_NEXT((elm), field);                   \
 } while (0)
 
-#define LIST_NEXT(elm, field)   ((elm)->field.le_next)
+#define TAILQ_NEXT(elm, field) ((elm)->field.tqe_next)
 
-#define LIST_REMOVE(elm, field) do {                                    \
-        if (LIST_NEXT((elm), field) != NULL)                            \
-                LIST_NEXT((elm), field)->field.le_prev =                \
-                    (elm)->field.le_prev;                               \
-        *(elm)->field.le_prev = LIST_NEXT((elm), field);                \
+#define TAILQ_REMOVE(head, elm, field) do {                             \
+        if ((TAILQ_NEXT((elm), field)) != NULL)                         \
+                TAILQ_NEXT((elm), field)->field.tqe_prev =              \
+                    (elm)->field.tqe_prev;                              \
+        else                                                            \
+                (head)->tqh_last = (elm)->field.tqe_prev;               \
+        *(elm)->field.tqe_prev = TAILQ_NEXT((elm), field);              \
 } while (0)
 /* ------------------------------------------------------------------------ */
 
 
 
-LIST_HEAD(conn_list_head, connection) connlist =
-    LIST_HEAD_INITIALIZER(conn_list_head);
+/* Every event loop thread has its own connlist.  It's kept in order of
+ * last_active, and since every connection has the same idletime, that's also
+ * the order in which they time out.
+ */
+static __thread TAILQ_HEAD(conn_list_head, connection) connlist;
+
+/* Precompressed versions of a file are found next to it, with a suffix for
+ * their Content-Encoding.  On a tie, the first one the client accepts wins.
+ */
+static const struct
+{
+    const char *name, *suffix;
+} encodings[] = {
+    { "br",   ".br" },
+    { "zstd", ".zst" },
+    { "gzip", ".gz" }
+};
+#define NUM_ENCODINGS (sizeof(encodings) / sizeof(*encodings))
+#define ENCODING_SUFFIX_MAX 4 /* strlen(".zst") */
+
+/* A precompressed version that fs_lookup() opened. */
+struct fs_sidecar
+{
+    int fd;
+    struct stat st;
+    char *data;
+};
+
+/* The filesystem part of a GET/HEAD request: see fs_lookup(). */
+struct fs_lookup
+{
+    char *target;           /* file to open, with room for a suffix */
+    char *dir;              /* directory to list instead if there's no
+                               target, or NULL */
+    const char *mimetype;
+    const struct file_entry *cached; /* stale entry to check target against */
+
+    /* results */
+    int fd, error;
+    struct stat st;
+    char *data;             /* contents of a small file, or NULL */
+    struct fs_sidecar *sidecar[NUM_ENCODINGS]; /* or NULL */
+    int listing;            /* dir was listed instead of opening target */
+    struct dlent **list;
+    ssize_t listsize;
+
+    /* worker pool bookkeeping */
+    struct fs_done_queue *owner;
+    struct connection *next;
+};
+
+/* Bump allocator for request-scoped strings, see arena_alloc(). */
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[];
+};
+
+struct arena
+{
+    struct arena_chunk *head; /* chunk being filled, the first one is last */
+};
+
+/* A request header, both parts NUL-terminated in place in the request. */
+struct header
+{
+    const char *name;
+    size_t name_length; /* compared first, it rules out most names */
+    char *value;
+};
+
+/* Headers past this many aren't looked at. */
+#define MAX_HEADERS 32
+
+/* A range from a Range: field, which is resolve_ranges()'d into [begin, end]
+ * once we know the file's size.  -500 has only an end, the suffix length.
+ */
+struct byte_range
+{
+    off_t begin, end;
+    int begin_given, end_given;
+};
+
+/* Range: fields with more ranges than this are ignored. */
+#define MAX_RANGES 16
+
+/* One part of a multipart/byteranges reply: the part's header, then
+ * [length] bytes of the file from [offset].
+ */
+struct reply_part
+{
+    char *header;
+    size_t header_length;
+    off_t offset, length;
+};
 
 struct connection
 {
-    LIST_ENTRY(connection) entries;
+    TAILQ_ENTRY(connection) entries;
 
     int socket;
+    int ev_mask; /* EV_* events currently registered with the backend */
+#ifdef HAVE_OPENSSL
+    SSL *ssl;     /* NULL for plain HTTP */
+    int tls_want; /* EV_* the handshake is waiting for */
+    int ktls;     /* the kernel encrypts what we send on the socket */
+#endif
     in_addr_t client;
     time_t last_active;
     enum {
+        TLS_HANDSHAKE,  /* TLS handshake in progress */
         RECV_REQUEST,   /* receiving request */
+        WAIT_FS,        /* waiting for the fs worker pool, not in connlist */
         SEND_HEADER,    /* sending generated header */
         SEND_REPLY,     /* sending reply */
         DONE            /* connection closed, need to remove from queue */
         } state;
 
-    /* char request[request_length+1] is null-terminated */
+    /* char request[request_length+1] is null-terminated, and is one of the
+     * REQUEST_BUFSIZE buffers from the pool while we're receiving
+     */
     char *request;
     size_t request_length;
+    size_t request_scanned; /* find_request_end() got this far */
+    size_t request_end;     /* length of this request, pipelined ones follow */
+    int pipelined;          /* another whole request follows this one */
 
-    /* request fields */
+    /* request fields, all pointing into request */
     char *method, *uri, *referer, *user_agent;
-    size_t range_begin, range_end;
-    int range_begin_given, range_end_given;
+    struct header *headers;
+    int num_headers;
+    struct byte_range *ranges;
+    int num_ranges;
 
     char *header;
     size_t header_length, header_sent;
-    int header_dont_free, header_only, http_code, conn_close;
+    int header_only, http_code, conn_close;
 
-    enum { REPLY_GENERATED, REPLY_FROMFILE } reply_type;
+    struct fs_lookup fs;
+
+    enum { REPLY_GENERATED, REPLY_FROMFILE, REPLY_MULTIPART } reply_type;
     char *reply;
-    int reply_dont_free;
     int reply_fd;
-    size_t reply_start, reply_length, reply_sent;
+    struct file_entry *file; /* holds a reference, reply_fd belongs to it */
+    off_t reply_start, reply_length, reply_sent;
+    struct reply_part *parts; /* of a REPLY_MULTIPART */
+    int num_parts, part;
+    off_t part_sent;
+
+    uint64_t total_sent; /* header + body = total, for logging */
 
-    unsigned int total_sent; /* header + body = total, for logging */
+    /* method, uri, header, reply and everything else that only lives as
+     * long as the request
+     */
+    struct arena arena;
 };
 
 struct mime_mapping
@@ -230,32 +390,104 @@ size_t longest_ext = 0;
 /* Time is cached in the event loop to avoid making an excessive number of
  * gettimeofday() calls.
  */
-static time_t now;
+static __thread time_t now;
 
 /* To prevent a malformed request from eating up too much memory, die once the
  * request exceeds this many bytes:
  */
 #define MAX_REQUEST_LENGTH 4000
 
+/* Requests are received into buffers this big: one byte more than the
+ * longest request, so we can tell it's too long, and the terminating NUL.
+ */
+#define REQUEST_BUFSIZE (MAX_REQUEST_LENGTH + 2)
+
+/* Connection slabs past the --conn-prealloc one hold this many. */
+#define CONN_SLAB_GROW 64
+
+/* File bodies up to this size are read in and sent in the same writev() as
+ * the header, bigger ones follow it with sendfile().
+ */
+#define COALESCE_MAX 16384
+
+/* Most we hand to one sendfile(), so the count fits in a size_t and the
+ * return value in a ssize_t on 32-bit platforms too.
+ */
+#define SENDFILE_MAX ((off_t)1 << 30)
+
 
 /* Defaults can be overridden on the command-line */
 static int idletime = 60; /*idle time before timeout*/
 static char *keep_alive_field = NULL;
+static char *server_field = NULL;
+static size_t server_field_length = 0;
+static char boundary[20];   /* for multipart/byteranges, made up at startup */
 static in_addr_t bindaddr = INADDR_ANY;
 static unsigned short bindport = 80;
 static int max_connections = -1;        /* kern.ipc.somaxconn */
+static int accept_batch = 64;           /* accepts per wakeup */
+static int conn_prealloc = 64;          /* connections per event loop */
 static const char *index_name = "index.html";
-
-static int sockin = -1;             /* socket to accept connections from */
+static const char *ev_name = NULL;  /* NULL = best available backend */
+
+static __thread int sockin = -1;    /* socket to accept connections from */
+static int *listeners = NULL;       /* every event loop's sockin */
+static int num_listeners = 1;
+static int listener_base = 0;       /* this process' first listener */
+static int num_workers = 0;         /* 0 = serve from this process */
+static int num_threads = 1;         /* event loops per process */
+static int fs_threads = 0;          /* 0 = open files in the event loop */
+static size_t cache_size = 16 << 20; /* bytes of file contents kept in memory */
+static size_t cache_max_file = 64 << 10; /* biggest file kept in memory */
+static size_t send_quantum = 128 << 10; /* sent to a connection per turn */
+#ifdef HAVE_OPENSSL
+static SSL_CTX *tls_ctx = NULL;     /* NULL = plain HTTP */
+static const char *tls_cert = NULL, *tls_key = NULL; /* PEM file names */
+#endif
 static char *wwwroot = NULL;        /* a path name */
 static char *logfile_name = NULL;   /* NULL = no logging */
 static FILE *logfile = NULL;
 static char *pidfile_name = NULL;   /* NULL = no pidfile */
 static int want_chroot = 0, want_daemon = 0, want_accf = 0;
-static uint32_t num_requests = 0;
-static uint64_t total_in = 0, total_out = 0;
 
-static int running = 1; /* signal handler sets this to false */
+/* Traffic counters.  Each event loop only ever updates its own slot, and the
+ * slots live in shared memory so that the supervisor can add up the work of
+ * its workers - including ones that have crashed - at shutdown.
+ */
+struct httpd_stats
+{
+    uint32_t num_requests;
+    uint64_t total_in, total_out;
+    uint32_t num_accepts, accept_wakeups, accept_drops;
+    uint32_t conns_open, conns_high_water, conn_slab_size;
+    uint32_t cache_hits, cache_misses, cache_evictions;
+    uint32_t tls_handshakes, tls_resumed, tls_ktls;
+};
+static struct httpd_stats *stats_slots = NULL;
+static __thread struct httpd_stats *stats = NULL;
+
+/* Connections open across every loop and worker right now, and the most
+ * there have been at once.  In the same shared memory as stats_slots.
+ */
+struct conn_count
+{
+    uint32_t open, peak;
+};
+static struct conn_count *conn_count = NULL;
+
+static volatile sig_atomic_t running = 1; /* signal handler sets this to
+                                             false */
+static volatile sig_atomic_t upgrade_pending = 0; /* SIGHUP or SIGUSR2 */
+static volatile sig_atomic_t draining = 0; /* stop accepting, finish up */
+static int is_worker = 0;
+static int upgraded = 0;   /* we took our listeners over from an old shttpd */
+static int handed_off = 0; /* a new shttpd took them over from us */
+static __thread int upgrade_fd = -1; /* its ready pipe, while it starts */
+static __thread time_t upgrade_deadline;
+static char upgrade_tag; /* ev_event data for the ready pipe */
+static pid_t upgrade_pid;
+static int upgrade_status, upgrade_reaped;
+static char **saved_argv = NULL;
 
 #define INVALID_UID ((uid_t) -1)
 #define INVALID_GID ((gid_t) -1)
@@ -298,6 +530,17 @@ static const char default_mimetype[] = "application/octet-stream";
 static void poll_recv_request(struct connection *conn);
 static void poll_send_header(struct connection *conn);
 static void poll_send_reply(struct connection *conn);
+static void finish_poll(struct connection *conn);
+static void file_cache_release(struct file_entry *e);
+static void fs_release_sidecars(struct fs_lookup *fs);
+static void touch_connection(struct connection *conn);
+static ssize_t send_from_file(const int s, const int fd,
+    off_t ofs, const off_t length);
+#ifdef HAVE_OPENSSL
+static void tls_accept(struct connection *conn);
+static void tls_handshake(struct connection *conn);
+static void tls_close(struct connection *conn);
+#endif
 
 
 /* ---------------------------------------------------------------------------
@@ -375,6 +618,118 @@ static unsigned int xasprintf(char **ret, const char *format, ...)
 }
 
 
+
+/* ---------------------------------------------------------------------------
+ * Per-connection arena.  Request-scoped strings are bumped out of it and are
+ * all thrown away at once by arena_reset() when the request is done.  The
+ * first chunk survives the reset (and the connection, see conn_slab_grow()),
+ * so a typical request doesn't call malloc at all.
+ */
+#define ARENA_CHUNK 4096
+
+static void *arena_alloc(struct arena *a, const size_t len)
+{
+    struct arena_chunk *c = a->head;
+    const size_t size = (len > ARENA_CHUNK) ? len : ARENA_CHUNK;
+    size_t at;
+
+    if (c != NULL)
+    {
+        at = (c->used + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        if (at + len <= c->size)
+        {
+            c->used = at + len;
+            return c->data + at;
+        }
+    }
+    c = xmalloc(sizeof(struct arena_chunk) + size);
+    c->size = size;
+    c->used = len;
+    c->next = a->head;
+    a->head = c;
+    return c->data;
+}
+
+static char *arena_strndup(struct arena *a, const char *src,
+    const size_t len)
+{
+    char *dest = arena_alloc(a, len + 1);
+
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+    return dest;
+}
+
+// xvasprintf() into the arena.
+static unsigned int arena_vasprintf(struct arena *a, char **ret,
+    const char *format, va_list ap)
+{
+    struct arena_chunk *c = a->head;
+    size_t room = 0;
+    va_list again;
+    int len;
+
+    /* try formatting straight into the current chunk */
+    if (c != NULL && c->used < c->size) room = c->size - c->used;
+    va_copy(again, ap);
+    len = vsnprintf(room ? c->data + c->used : NULL, room, format, ap);
+    if (len < 0) errx(1, "vsnprintf() failed");
+    if ((size_t)len < room)
+    {
+        *ret = c->data + c->used;
+        c->used += len + 1;
+    }
+    else
+    {
+        *ret = arena_alloc(a, len + 1);
+        vsnprintf(*ret, len + 1, format, again);
+    }
+    va_end(again);
+    return (unsigned int)len;
+}
+
+// xasprintf() into the arena.
+static unsigned int arena_asprintf(struct arena *a, char **ret,
+    const char *format, ...)
+{
+    va_list va;
+    unsigned int len;
+
+    va_start(va, format);
+    len = arena_vasprintf(a, ret, format, va);
+    va_end(va);
+    return len;
+}
+
+// Empty the arena, keeping its first chunk if that's the usual size.
+static void arena_reset(struct arena *a)
+{
+    struct arena_chunk *c;
+
+    while ((c = a->head) != NULL)
+    {
+        if (c->next == NULL && c->size == ARENA_CHUNK)
+        {
+            c->used = 0;
+            return;
+        }
+        a->head = c->next;
+        free(c);
+    }
+}
+
+static void arena_free(struct arena *a)
+{
+    struct arena_chunk *c;
+
+    while ((c = a->head) != NULL)
+    {
+        a->head = c->next;
+        free(c);
+    }
+}
+
+
 /* ---------------------------------------------------------------------------
  * Append buffer code.  A somewhat efficient string buffer with pool-based
  * reallocation.
@@ -452,181 +807,410 @@ nonblock_socket(const int sock)
 }
 
 
+// Don't leak the descriptor into a new binary when upgrading.
+static void
+cloexec_fd(const int fd)
+{
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+        err(1, "fcntl() to set FD_CLOEXEC");
+}
+
+
 
-//Split string out of src with range [left:right-1]
-static char *split_string(const char *src,
-    const size_t left, const size_t right)
+/* ---------------------------------------------------------------------------
+ * Event backends.  A descriptor is registered once and its interest mask is
+ * only changed when its connection moves between receiving and sending, so
+ * the main loop never has to rebuild anything from the whole connlist.
+ * ev->wait() fills [out] with just the descriptors that are ready.
+ */
+#define EV_READ  1
+#define EV_WRITE 2
+#define EV_MAX_EVENTS 256 /* events handled per wakeup */
+
+struct ev_event
 {
-    char *dest;
-    assert(left <= right);
-    assert(left < strlen(src));   /* [left means must be smaller */
-    assert(right <= strlen(src)); /* right) means can be equal or smaller */
+    void *data;
+    int events;
+};
 
-    dest = xmalloc(right - left + 1);
-    memcpy(dest, src+left, right-left);
-    dest[right-left] = '\0';
-    return dest;
-}
+struct ev_backend
+{
+    const char *name;
+    int (*init)(void);
+    /* old_mask == 0 registers [fd], new_mask == 0 unregisters it */
+    int (*set)(const int fd, void *data, const int old_mask,
+        const int new_mask);
+    int (*wait)(const int timeout_ms, struct ev_event *out, const int max);
+};
 
+static const struct ev_backend *ev = NULL; /* shared by all threads */
 
+/* select() - portable, but limited to FD_SETSIZE descriptors and O(max_fd)
+ * per wakeup.
+ */
+static __thread fd_set select_recv_set, select_send_set;
+static __thread void *select_data[FD_SETSIZE];
+static __thread int select_max_fd = -1;
+static __thread int select_next_fd = 0; /* where the next scan starts */
+
+static int select_init(void)
+{
+    FD_ZERO(&select_recv_set);
+    FD_ZERO(&select_send_set);
+    return 0;
+}
 
-// Consolidate slashes in-place by shifting parts of the string over repeated slashes.
-static void consolidate_slashes(char *s)
+static int select_set(const int fd, void *data, const int old_mask,
+    const int new_mask)
 {
-    size_t left = 0, right = 0;
-    int saw_slash = 0;
+    (void)old_mask;
+    if (fd >= FD_SETSIZE)
+    {
+        errno = EMFILE;
+        return -1;
+    }
 
-    assert(s != NULL);
+    if (new_mask & EV_READ) FD_SET(fd, &select_recv_set);
+    else FD_CLR(fd, &select_recv_set);
+    if (new_mask & EV_WRITE) FD_SET(fd, &select_send_set);
+    else FD_CLR(fd, &select_send_set);
 
-    while (s[right] != '\0')
+    if (new_mask != 0)
     {
-        if (saw_slash)
-        {
-            if (s[right] == '/') right++;
-            else
-            {
-                saw_slash = 0;
-                s[left++] = s[right++];
-            }
-        }
-        else
-        {
-            if (s[right] == '/') saw_slash++;
-            s[left++] = s[right++];
-        }
+        select_data[fd] = data;
+        if (fd > select_max_fd) select_max_fd = fd;
     }
-    s[left] = '\0';
+    else if (fd == select_max_fd)
+    {
+        while (select_max_fd >= 0 &&
+            !FD_ISSET(select_max_fd, &select_recv_set) &&
+            !FD_ISSET(select_max_fd, &select_send_set))
+                select_max_fd--;
+    }
+    return 0;
 }
 
-
-// Resolve /./ and /../ in a URI, in-place.  Returns NULL if the URI is
-//invalid/unsafe, or the original buffer if successful.
-static char *make_safe_uri(char *uri)
+static int select_wait(const int timeout_ms, struct ev_event *out,
+    const int max)
 {
-    struct {
-        char *start;
-        size_t len;
-    } *chunks;
-    unsigned int num_slashes, num_chunks;
-    size_t urilen, i, j, pos;
-    int ends_in_slash;
+    fd_set recv_set = select_recv_set, send_set = select_send_set;
+    struct timeval timeout;
+    int fd, i, ret, num = 0;
 
-    assert(uri != NULL);
-    if (uri[0] != '/') return NULL;
-    consolidate_slashes(uri);
-    urilen = strlen(uri);
-    if (urilen > 0)
-        ends_in_slash = (uri[urilen-1] == '/');
-    else
-        ends_in_slash = 1;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
 
-    /* count the slashes */
-    for (i=0, num_slashes=0; i<urilen; i++)
-        if (uri[i] == '/') num_slashes++;
+    ret = select(select_max_fd + 1, &recv_set, &send_set, NULL,
+        (timeout_ms < 0) ? NULL : &timeout);
+    if (ret <= 0) return ret;
 
-    /* make an array for the URI elements */
-    chunks = xmalloc(sizeof(*chunks) * num_slashes);
+    /* with more than [max] ready, carry on from here next time, so that
+     * the high fds get their turn
+     */
+    if (select_next_fd > select_max_fd) select_next_fd = 0;
+    for (i = 0, fd = select_next_fd; i <= select_max_fd && num < max; i++)
+    {
+        int events = 0;
+        if (FD_ISSET(fd, &recv_set)) events |= EV_READ;
+        if (FD_ISSET(fd, &send_set)) events |= EV_WRITE;
+        if (events != 0)
+        {
+            out[num].data = select_data[fd];
+            out[num].events = events;
+            num++;
+        }
+        if (++fd > select_max_fd) fd = 0;
+    }
+    select_next_fd = fd;
+    return num;
+}
 
-    /* split by slashes and build chunks array */
-    num_chunks = 0;
-    for (i=1; i<urilen;) {
-        /* look for the next slash */
-        for (j=i; j<urilen && uri[j] != '/'; j++)
-            ;
+#ifdef __linux
+/* epoll - no descriptor limit, and the cost of a wakeup only depends on how
+ * many descriptors are ready.
+ */
+static __thread int epoll_fd = -1;
 
-        /* process uri[i,j) */
-        if ((j == i+1) && (uri[i] == '.'))
-            /* "." */;
-        else if ((j == i+2) && (uri[i] == '.') && (uri[i+1] == '.')) {
-            /* ".." */
-            if (num_chunks == 0) {
-                /* unsafe string so free chunks */
-                free(chunks);
-                return (NULL);
-            } else
-                num_chunks--;
-        } else {
-            chunks[num_chunks].start = uri+i;
-            chunks[num_chunks].len = j-i;
-            num_chunks++;
-        }
+static int epoll_init(void)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return (epoll_fd == -1) ? -1 : 0;
+}
 
-        i = j + 1; /* uri[j] is a slash - move along one */
-    }
+static int epoll_set(const int fd, void *data, const int old_mask,
+    const int new_mask)
+{
+    struct epoll_event e;
+    int op;
 
-    /* reassemble in-place */
-    pos = 0;
-    for (i=0; i<num_chunks; i++) {
-        assert(pos <= urilen);
-        uri[pos++] = '/';
+    if (old_mask == 0) op = EPOLL_CTL_ADD;
+    else if (new_mask == 0) op = EPOLL_CTL_DEL;
+    else op = EPOLL_CTL_MOD;
 
-        assert(pos + chunks[i].len <= urilen);
-        assert(uri + pos <= chunks[i].start);
+    e.events = ((new_mask & EV_READ) ? EPOLLIN : 0) |
+               ((new_mask & EV_WRITE) ? EPOLLOUT : 0);
+    e.data.ptr = data;
+    return epoll_ctl(epoll_fd, op, fd, &e);
+}
 
-        if (uri+pos < chunks[i].start)
-            memmove(uri+pos, chunks[i].start, chunks[i].len);
-        pos += chunks[i].len;
-    }
-    free(chunks);
+static int epoll_wait_events(const int timeout_ms, struct ev_event *out,
+    const int max)
+{
+    struct epoll_event events[EV_MAX_EVENTS];
+    int i, ret;
 
-    if ((num_chunks == 0) || ends_in_slash) uri[pos++] = '/';
-    assert(pos <= urilen);
-    uri[pos] = '\0';
-    return uri;
+    ret = epoll_wait(epoll_fd, events, min(max, EV_MAX_EVENTS), timeout_ms);
+    for (i = 0; i < ret; i++)
+    {
+        out[i].data = events[i].data.ptr;
+        out[i].events = 0;
+        /* errors and hangups are reported to whichever side is waiting, so
+         * that the next recv() or send() picks them up.
+         */
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            out[i].events |= EV_READ;
+        if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            out[i].events |= EV_WRITE;
+    }
+    return ret;
 }
+#endif
 
+/* In order of preference. */
+static const struct ev_backend ev_backends[] = {
+#ifdef __linux
+    { "epoll", epoll_init, epoll_set, epoll_wait_events },
+#endif
+    { "select", select_init, select_set, select_wait },
+    { NULL, NULL, NULL, NULL }
+};
 
-// Associates an extension with a mimetype in the mime_map.  Entries are in
-// unsorted order.  Makes copies of extension and mimetype strings.
-static void add_mime_mapping(const char *extension, const char *mimetype)
+/* Pick ev_name if it was given, otherwise the first backend that works, and
+ * initialize it for the calling thread.  Other threads just call ev->init().
+ */
+static void ev_init(void)
 {
-    size_t i;
-    assert(strlen(extension) > 0);
-    assert(strlen(mimetype) > 0);
-
-    /* update longest_ext */
-    i = strlen(extension);
-    if (i > longest_ext) longest_ext = i;
+    const struct ev_backend *b;
 
-    /* look through list and replace an existing entry if possible */
-    for (i=0; i<mime_map_size; i++)
-        if (strcmp(mime_map[i].extension, extension) == 0)
+    for (b = ev_backends; b->name != NULL; b++)
+    {
+        if (ev_name != NULL && strcmp(ev_name, b->name) != 0) continue;
+        if (b->init() == 0)
         {
-            free(mime_map[i].mimetype);
-            mime_map[i].mimetype = xstrdup(mimetype);
+            ev = b;
+            if (debug) printf("using %s event backend\n", ev->name);
             return;
         }
+        if (ev_name != NULL) err(1, "%s event backend", ev_name);
+    }
+    if (ev_name != NULL) errx(1, "unknown event backend `%s'", ev_name);
+    errx(1, "no usable event backend");
+}
 
-    /* no replacement - add a new entry */
-    mime_map_size++;
-    mime_map = xrealloc(mime_map,
-        sizeof(struct mime_mapping) * mime_map_size);
-    mime_map[mime_map_size-1].extension = xstrdup(extension);
-    mime_map[mime_map_size-1].mimetype = xstrdup(mimetype);
+
+
+/* ---------------------------------------------------------------------------
+ * Every event loop has a wake channel registered next to its sockin, so that
+ * signal handlers and other threads can interrupt its wait.  This is an
+ * eventfd on Linux and a pipe elsewhere.
+ */
+static char wake_tag; /* ev_event data for the wake channel */
+static __thread int wake_fds[2] = { -1, -1 }; /* read end, write end */
+
+static void wake_init(void)
+{
+#ifdef __linux
+    wake_fds[0] = wake_fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fds[0] == -1) err(1, "eventfd()");
+#else
+    if (pipe(wake_fds) == -1) err(1, "pipe(wake)");
+    nonblock_socket(wake_fds[0]);
+    nonblock_socket(wake_fds[1]);
+    cloexec_fd(wake_fds[0]);
+    cloexec_fd(wake_fds[1]);
+#endif
+    if (ev->set(wake_fds[0], &wake_tag, 0, EV_READ) == -1)
+        err(1, "%s set(wake)", ev->name);
 }
 
+static void wake_close(void)
+{
+    (void)ev->set(wake_fds[0], &wake_tag, EV_READ, 0);
+    xclose(wake_fds[0]);
+    if (wake_fds[1] != wake_fds[0]) xclose(wake_fds[1]);
+    wake_fds[0] = wake_fds[1] = -1;
+}
 
-//qsort() the mime_map.  The map must be sorted before it can be searched through.
-static int mime_mapping_cmp(const void *a, const void *b)
+/* Wake the loop that owns the write end [fd].  Async-signal-safe. */
+static void wake_loop(const int fd)
 {
-    return strcmp( ((const struct mime_mapping *)a)->extension,
-                   ((const struct mime_mapping *)b)->extension );
+    uint64_t one = 1;
+    ssize_t ret = write(fd, &one, sizeof(one));
+    (void)ret; /* if it's full, the loop is going to wake up anyway */
 }
 
-static void sort_mime_map(void)
+static void wake_drain(void)
 {
-    qsort(mime_map, mime_map_size, sizeof(struct mime_mapping),
-        mime_mapping_cmp);
+    uint64_t buf[8];
+    while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+        ;
 }
 
 
 
-//Parses a mime.types line and adds the parsed data to the mime_map.
-static void parse_mimetype_line(const char *line)
+//Split string out of src with range [left:right-1]
+static char *split_string(const char *src,
+    const size_t left, const size_t right)
 {
-    unsigned int pad, bound1, lbound, rbound;
+    char *dest;
+    assert(left <= right);
+    assert(left < strlen(src));   /* [left means must be smaller */
+    assert(right <= strlen(src)); /* right) means can be equal or smaller */
 
-    /* parse mimetype */
+    dest = xmalloc(right - left + 1);
+    memcpy(dest, src+left, right-left);
+    dest[right-left] = '\0';
+    return dest;
+}
+
+
+
+// Resolve a "." or ".." segment out[seg, pos) of a URI being built by
+//resolve_uri().  Returns the new end of the URI, or -1 if ".." would go above
+//the root.
+static ssize_t resolve_segment(const char *out, size_t seg, const size_t pos)
+{
+    if (pos - seg == 1 && out[seg] == '.')
+        return seg;
+    if (pos - seg == 2 && out[seg] == '.' && out[seg+1] == '.')
+    {
+        if (seg == 1) return -1; /* unsafe */
+        for (seg -= 2; out[seg] != '/'; seg--)
+            ;
+        return seg + 1;
+    }
+    return pos;
+}
+
+// Decode %XX escapes in a URI, collapse repeated slashes and resolve /./ and
+//  /../, all in one pass, writing the result to [out] - which needs as much
+//room as the URI.  Returns the length of the result, or -1 if the URI is
+//invalid/unsafe.  Sets [*ext] to where the extension in the last segment
+//starts, or 0 if there isn't one.
+static ssize_t resolve_uri(char *out, const char *uri, size_t *ext)
+{
+    size_t pos = 0, seg = 0;
+    ssize_t end;
+    unsigned char c = 0;
+
+    #define HEX_TO_DIGIT(hex) ( \
+        ((hex) >= 'A' && (hex) <= 'F') ? ((hex)-'A'+10): \
+        ((hex) >= 'a' && (hex) <= 'f') ? ((hex)-'a'+10): \
+        ((hex)-'0') )
+
+    while (*uri != '\0')
+    {
+        c = (unsigned char)*uri++;
+        if (c == '%' && isxdigit((unsigned char)uri[0]) &&
+            isxdigit((unsigned char)uri[1]))
+        {
+            c = HEX_TO_DIGIT(uri[0]) * 16 + HEX_TO_DIGIT(uri[1]);
+            uri += 2;
+            if (c == '\0') return -1; /* would truncate the path */
+        }
+
+        if (c != '/')
+        {
+            if (pos == 0) return -1; /* must start with a slash */
+            out[pos++] = c;
+        }
+        else if (pos == 0 || out[pos-1] != '/')
+        {
+            /* end of a segment */
+            if ((end = resolve_segment(out, seg, pos)) == -1) return -1;
+            pos = end;
+            if (pos == 0 || out[pos-1] != '/') out[pos++] = '/';
+            seg = pos;
+        }
+        /* else collapse repeated slashes */
+    }
+    #undef HEX_TO_DIGIT
+    if (pos == 0) return -1;
+
+    /* a trailing "." or ".." doesn't leave a trailing slash, except at the
+     * root
+     */
+    if ((end = resolve_segment(out, seg, pos)) == -1) return -1;
+    if ((size_t)end != pos)
+    {
+        pos = end;
+        if (pos > 1) pos--;
+    }
+    out[pos] = '\0';
+
+    /* find the extension */
+    *ext = 0;
+    for (end = pos - 1; end > 0 && out[end] != '/'; end--)
+        if (out[end] == '.')
+        {
+            *ext = end + 1;
+            break;
+        }
+    return pos;
+}
+
+
+// Associates an extension with a mimetype in the mime_map.  Entries are in
+// unsorted order.  Makes copies of extension and mimetype strings.
+static void add_mime_mapping(const char *extension, const char *mimetype)
+{
+    size_t i;
+    assert(strlen(extension) > 0);
+    assert(strlen(mimetype) > 0);
+
+    /* update longest_ext */
+    i = strlen(extension);
+    if (i > longest_ext) longest_ext = i;
+
+    /* look through list and replace an existing entry if possible */
+    for (i=0; i<mime_map_size; i++)
+        if (strcmp(mime_map[i].extension, extension) == 0)
+        {
+            free(mime_map[i].mimetype);
+            mime_map[i].mimetype = xstrdup(mimetype);
+            return;
+        }
+
+    /* no replacement - add a new entry */
+    mime_map_size++;
+    mime_map = xrealloc(mime_map,
+        sizeof(struct mime_mapping) * mime_map_size);
+    mime_map[mime_map_size-1].extension = xstrdup(extension);
+    mime_map[mime_map_size-1].mimetype = xstrdup(mimetype);
+}
+
+
+//qsort() the mime_map.  The map must be sorted before it can be searched through.
+static int mime_mapping_cmp(const void *a, const void *b)
+{
+    return strcmp( ((const struct mime_mapping *)a)->extension,
+                   ((const struct mime_mapping *)b)->extension );
+}
+
+static void sort_mime_map(void)
+{
+    qsort(mime_map, mime_map_size, sizeof(struct mime_mapping),
+        mime_mapping_cmp);
+}
+
+
+
+//Parses a mime.types line and adds the parsed data to the mime_map.
+static void parse_mimetype_line(const char *line)
+{
+    unsigned int pad, bound1, lbound, rbound;
+
+    /* parse mimetype */
     for (pad=0; line[pad] == ' ' || line[pad] == '\t'; pad++);
     if (line[pad] == '\0' || /* empty line */
         line[pad] == '#')    /* comment */
@@ -767,6 +1351,17 @@ static int mime_mapping_cmp_str(const void *a, const void *b) {
     );
 }
 
+static const char *ext_content_type(const char *ext) {
+    struct mime_mapping *result;
+
+    if (strlen(ext) > longest_ext) return default_mimetype;
+    result = bsearch(ext, mime_map, mime_map_size,
+        sizeof(struct mime_mapping), mime_mapping_cmp_str);
+    if (result == NULL) return default_mimetype;
+    assert(strcmp(ext, result->extension) == 0);
+    return result->mimetype;
+}
+
 static const char *uri_content_type(const char *uri) {
     size_t period, urilen = strlen(uri);
 
@@ -778,52 +1373,57 @@ static const char *uri_content_type(const char *uri) {
             ;
 
     if (uri[period] == '.')
-    {
-        struct mime_mapping *result =
-            bsearch((uri+period+1), mime_map, mime_map_size,
-            sizeof(struct mime_mapping), mime_mapping_cmp_str);
-
-        if (result != NULL)
-        {
-            assert(strcmp(uri+period+1, result->extension) == 0);
-            return result->mimetype;
-        }
-    }
+        return ext_content_type(uri+period+1);
     /* else no period found in the string */
     return default_mimetype;
 }
 
 
-//Initialize the sockin global.  This is the socket that we accept connections from.
-static void init_sockin(void)
+//Create a socket to accept connections from, bound to bindaddr:bindport.
+static int make_listener(void)
 {
     struct sockaddr_in addrin;
-    int sockopt;
+    int fd, sockopt;
 
     /* create incoming socket */
-    sockin = socket(PF_INET, SOCK_STREAM, 0);
-    if (sockin == -1) err(1, "socket()");
+    fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1) err(1, "socket()");
 
     /* reuse address */
     sockopt = 1;
-    if (setsockopt(sockin, SOL_SOCKET, SO_REUSEADDR,
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
             &sockopt, sizeof(sockopt)) == -1)
         err(1, "setsockopt(SO_REUSEADDR)");
 
-#if 0
-    /* disable Nagle since we buffer everything ourselves */
+    /* every worker gets its own socket on the same port, and the kernel
+     * spreads incoming connections across them
+     */
+    if (num_listeners > 1)
+    {
+#ifdef SO_REUSEPORT
+        sockopt = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                &sockopt, sizeof(sockopt)) == -1)
+            err(1, "setsockopt(SO_REUSEPORT)");
+#else
+        errx(1, "this platform doesn't support SO_REUSEPORT");
+#endif
+    }
+
+    /* disable Nagle since we buffer everything ourselves: header and body
+     * go out together, accepted sockets inherit this
+     */
     sockopt = 1;
-    if (setsockopt(sockin, IPPROTO_TCP, TCP_NODELAY,
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
             &sockopt, sizeof(sockopt)) == -1)
         err(1, "setsockopt(TCP_NODELAY)");
-#endif
 
 #ifdef TORTURE
     /* torture: cripple the kernel-side send buffer so we can only squeeze out
      * one byte at a time (this is for debugging)
      */
     sockopt = 1;
-    if (setsockopt(sockin, SOL_SOCKET, SO_SNDBUF,
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
             &sockopt, sizeof(sockopt)) == -1)
         err(1, "setsockopt(SO_SNDBUF)");
 #endif
@@ -833,22 +1433,21 @@ static void init_sockin(void)
     addrin.sin_port = htons(bindport);
     addrin.sin_addr.s_addr = bindaddr;
     memset(&(addrin.sin_zero), 0, 8);
-    if (bind(sockin, (struct sockaddr *)&addrin,
+    if (bind(fd, (struct sockaddr *)&addrin,
             sizeof(struct sockaddr)) == -1)
         err(1, "bind(port %u)", bindport);
 
-    printf("listening on %s:%u\n", inet_ntoa(addrin.sin_addr), bindport);
-
     /* listen on socket */
-    if (listen(sockin, max_connections) == -1)
+    if (listen(fd, max_connections) == -1)
         err(1, "listen()");
+    nonblock_socket(fd); /* so that we can drain the backlog */
 
     /* enable acceptfilter (this is only available on FreeBSD) */
     if (want_accf)
     {
 #if defined(__FreeBSD__)
         struct accept_filter_arg filt = {"httpready", ""};
-        if (setsockopt(sockin, SOL_SOCKET, SO_ACCEPTFILTER,
+        if (setsockopt(fd, SOL_SOCKET, SO_ACCEPTFILTER,
             &filt, sizeof(filt)) == -1)
             fprintf(stderr, "cannot enable acceptfilter: %s\n",
                 strerror(errno));
@@ -858,6 +1457,58 @@ static void init_sockin(void)
         printf("this platform doesn't support acceptfilter\n");
 #endif
     }
+    return fd;
+}
+
+
+//When an old shttpd upgrades to us, it passes its listeners in the
+//environment.  Take over as many as we need and return how many that was.
+#define LISTEN_FDS_ENV "SHTTPD_LISTEN_FDS"
+#define READY_FD_ENV "SHTTPD_READY_FD"
+#define UPGRADE_TIMEOUT 30 /* seconds for the new shttpd to say it's ready */
+
+static int inherit_listeners(void)
+{
+    const char *fds = getenv(LISTEN_FDS_ENV);
+    char *end;
+    int n = 0;
+
+    if (fds == NULL) return 0;
+    while (*fds != '\0')
+    {
+        long fd = strtol(fds, &end, 10);
+
+        if (end == fds || fd < 0 || (*end != ',' && *end != '\0'))
+            errx(1, "invalid %s", LISTEN_FDS_ENV);
+        if (n < num_listeners)
+            listeners[n++] = (int)fd;
+        else
+            xclose((int)fd); /* we've been restarted with fewer */
+        fds = (*end == ',') ? end + 1 : end;
+    }
+    unsetenv(LISTEN_FDS_ENV);
+    return n;
+}
+
+//Initialize the listeners, one per worker, and the sockin global.  This is
+//the socket that we accept connections from.
+static void init_sockin(void)
+{
+    struct in_addr inaddr;
+    int i;
+
+    listeners = xmalloc(sizeof(int) * num_listeners);
+    upgraded = inherit_listeners();
+    for (i=upgraded; i<num_listeners; i++)
+        listeners[i] = make_listener();
+    sockin = listeners[0];
+
+    inaddr.s_addr = bindaddr;
+    if (upgraded)
+        printf("took over %d listening socket%s on port %u\n", upgraded,
+            (upgraded == 1) ? "" : "s", bindport);
+    else
+        printf("listening on %s:%u\n", inet_ntoa(inaddr), bindport);
 }
 
 
@@ -881,6 +1532,15 @@ static void usage(void)
     "\t\tSpecifies how many concurrent connections to accept.\n"
     "\n");
     printf(
+    "\t--accept-batch number (default: %d)\n" /* accept_batch */
+    "\t\tSpecifies how many connections to accept per wakeup.\n"
+    "\n", accept_batch);
+    printf(
+    "\t--conn-prealloc number (default: %d)\n" /* conn_prealloc */
+    "\t\tSpecifies how many connections each event loop allocates\n"
+    "\t\tup front.  It grows by %d at a time past that.\n"
+    "\n", conn_prealloc, CONN_SLAB_GROW);
+    printf(
     "\t--log filename (default: no logging)\n"
     "\t\tSpecifies which file to append the request log to.\n"
     "\n");
@@ -911,6 +1571,57 @@ static void usage(void)
     "\t\tand inside the wwwroot."
     "\n");
     printf(
+    "\t--workers number (default: 0)\n"
+    "\t\tFork this many worker processes to serve requests, each\n"
+    "\t\twith its own SO_REUSEPORT listening socket.  Crashed\n"
+    "\t\tworkers are restarted.\n"
+    "\n");
+    printf(
+    "\t--threads number (default: 1)\n"
+    "\t\tRun this many event loop threads in each process, each\n"
+    "\t\twith its own SO_REUSEPORT listening socket.\n"
+    "\n");
+    printf(
+    "\t--fs-threads number (default: 0)\n"
+    "\t\tOpen and stat files, and list directories, on a pool of\n"
+    "\t\tthis many threads so that slow disks don't stall the\n"
+    "\t\tevent loops.  0 does it in the event loops.\n"
+    "\n");
+    printf(
+    "\t--cache-size bytes (default: %lu)\n" /* cache_size */
+    "\t\tKeep up to this much of the contents of small files in\n"
+    "\t\tmemory, least recently used go first.  0 disables it.\n"
+    "\n", (unsigned long)cache_size);
+    printf(
+    "\t--cache-max-file bytes (default: %lu)\n" /* cache_max_file */
+    "\t\tOnly keep the contents of files up to this big.\n"
+    "\n", (unsigned long)cache_max_file);
+    printf(
+    "\t--send-quantum bytes (default: %lu)\n" /* send_quantum */
+    "\t\tSend at most this much to one connection before moving on\n"
+    "\t\tto the next, so big downloads can't hold up small ones.\n"
+    "\n", (unsigned long)send_quantum);
+#ifdef HAVE_OPENSSL
+    printf(
+    "\t--tls-cert filename (default: plain HTTP)\n"
+    "\t\tServe HTTPS with the PEM certificate chain in this file.\n"
+    "\t\tThe kernel encrypts replies (kTLS) where it can, so files\n"
+    "\t\tare still sent with sendfile().\n"
+    "\n");
+    printf(
+    "\t--tls-key filename (default: the --tls-cert file)\n"
+    "\t\tPEM private key for the certificate.\n"
+    "\n");
+#endif
+    printf(
+    "\t--events backend (default: %s)\n" /* ev_backends[0].name */
+    "\t\tEvent notification mechanism to use: ", ev_backends[0].name);
+    {
+        const struct ev_backend *b;
+        for (b = ev_backends; b->name != NULL; b++)
+            printf("%s%s", b->name, (b[1].name != NULL) ? ", " : ".\n\n");
+    }
+    printf(
     "\t--help \n"
     "\t\tprints this dialogue.\n"
     "\n");
@@ -979,6 +1690,21 @@ static void parse_commandline(const int argc, char *argv[]) {
             if (++i >= argc) errx(1, "missing number after --maxconn");
             max_connections = atoi(argv[i]);
         }
+        else if (strcmp(argv[i], "--accept-batch") == 0)
+        {
+            if (++i >= argc) errx(1, "missing number after --accept-batch");
+            accept_batch = atoi(argv[i]);
+            if (accept_batch < 1)
+                errx(1, "--accept-batch must be at least 1");
+        }
+        else if (strcmp(argv[i], "--conn-prealloc") == 0)
+        {
+            if (++i >= argc)
+                errx(1, "missing number after --conn-prealloc");
+            conn_prealloc = atoi(argv[i]);
+            if (conn_prealloc < 0)
+                errx(1, "--conn-prealloc can't be negative");
+        }
         else if (strcmp(argv[i], "--log") == 0)
         {
             if (++i >= argc) errx(1, "missing filename after --log");
@@ -1036,9 +1762,184 @@ static void parse_commandline(const int argc, char *argv[]) {
         {
             want_accf = 1;
         }
+        else if (strcmp(argv[i], "--workers") == 0)
+        {
+            if (++i >= argc) errx(1, "missing number after --workers");
+            num_workers = atoi(argv[i]);
+            if (num_workers < 0) errx(1, "--workers can't be negative");
+        }
+        else if (strcmp(argv[i], "--threads") == 0)
+        {
+            if (++i >= argc) errx(1, "missing number after --threads");
+            num_threads = atoi(argv[i]);
+            if (num_threads < 1) errx(1, "--threads must be at least 1");
+        }
+        else if (strcmp(argv[i], "--fs-threads") == 0)
+        {
+            if (++i >= argc) errx(1, "missing number after --fs-threads");
+            fs_threads = atoi(argv[i]);
+            if (fs_threads < 0) errx(1, "--fs-threads can't be negative");
+        }
+        else if (strcmp(argv[i], "--cache-size") == 0)
+        {
+            if (++i >= argc) errx(1, "missing number after --cache-size");
+            if (atol(argv[i]) < 0)
+                errx(1, "--cache-size can't be negative");
+            cache_size = (size_t)atol(argv[i]);
+        }
+        else if (strcmp(argv[i], "--cache-max-file") == 0)
+        {
+            if (++i >= argc)
+                errx(1, "missing number after --cache-max-file");
+            if (atol(argv[i]) < 0)
+                errx(1, "--cache-max-file can't be negative");
+            cache_max_file = (size_t)atol(argv[i]);
+        }
+        else if (strcmp(argv[i], "--send-quantum") == 0)
+        {
+            if (++i >= argc)
+                errx(1, "missing number after --send-quantum");
+            if (atol(argv[i]) < 1)
+                errx(1, "--send-quantum must be at least 1");
+            send_quantum = (size_t)atol(argv[i]);
+        }
+#ifdef HAVE_OPENSSL
+        else if (strcmp(argv[i], "--tls-cert") == 0)
+        {
+            if (++i >= argc) errx(1, "missing filename after --tls-cert");
+            tls_cert = argv[i];
+        }
+        else if (strcmp(argv[i], "--tls-key") == 0)
+        {
+            if (++i >= argc) errx(1, "missing filename after --tls-key");
+            tls_key = argv[i];
+        }
+#endif
+        else if (strcmp(argv[i], "--events") == 0)
+        {
+            if (++i >= argc) errx(1, "missing backend after --events");
+            ev_name = argv[i];
+        }
         else
             errx(1, "unknown argument `%s'", argv[i]);
     }
+#ifdef HAVE_OPENSSL
+    if (tls_key != NULL && tls_cert == NULL)
+        errx(1, "--tls-key needs --tls-cert");
+#endif
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Connection slab.  Each event loop carves its struct connections out of
+ * slabs that it keeps until it exits, threading free ones through their
+ * entries field, so steady-state accept and close don't call malloc.
+ */
+struct conn_slab
+{
+    struct conn_slab *next;
+    int size;
+    struct connection conns[];
+};
+
+static __thread struct conn_slab *conn_slabs = NULL;
+static __thread struct connection *conn_free = NULL;
+
+static void conn_slab_grow(const int n)
+{
+    struct conn_slab *slab = xmalloc(sizeof(struct conn_slab) +
+        sizeof(struct connection) * n);
+    int i;
+
+    slab->next = conn_slabs;
+    slab->size = n;
+    conn_slabs = slab;
+    for (i=n-1; i>=0; i--)
+    {
+        slab->conns[i].arena.head = NULL;
+        slab->conns[i].entries.tqe_next = conn_free;
+        conn_free = &slab->conns[i];
+    }
+    stats->conn_slab_size += n;
+}
+
+static struct connection *conn_alloc(void)
+{
+    struct connection *conn;
+    uint32_t open, peak;
+
+    if (conn_free == NULL) conn_slab_grow(CONN_SLAB_GROW);
+    conn = conn_free;
+    conn_free = conn->entries.tqe_next;
+    if (++stats->conns_open > stats->conns_high_water)
+        stats->conns_high_water = stats->conns_open;
+
+    open = __atomic_add_fetch(&conn_count->open, 1, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&conn_count->peak, __ATOMIC_RELAXED);
+    while (open > peak && !__atomic_compare_exchange_n(&conn_count->peak,
+            &peak, open, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return conn;
+}
+
+static void conn_release(struct connection *conn)
+{
+    conn->entries.tqe_next = conn_free;
+    conn_free = conn;
+    stats->conns_open--;
+    __atomic_sub_fetch(&conn_count->open, 1, __ATOMIC_RELAXED);
+}
+
+static void conn_slab_free(void)
+{
+    struct conn_slab *slab;
+    int i;
+
+    while ((slab = conn_slabs) != NULL)
+    {
+        conn_slabs = slab->next;
+        for (i=0; i<slab->size; i++)
+            arena_free(&slab->conns[i].arena);
+        free(slab);
+    }
+    conn_free = NULL;
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Request buffer pool.  A connection only holds a buffer while it's
+ * receiving or handling a request, so idle keep-alive connections cost no
+ * buffer memory; free buffers are kept per event loop, linked through their
+ * first bytes.
+ */
+static __thread char *reqbuf_free = NULL;
+
+static char *reqbuf_get(void)
+{
+    char *buf = reqbuf_free;
+
+    if (buf == NULL) return xmalloc(REQUEST_BUFSIZE);
+    memcpy(&reqbuf_free, buf, sizeof(char *));
+    return buf;
+}
+
+static void reqbuf_put(char *buf)
+{
+    memcpy(buf, &reqbuf_free, sizeof(char *));
+    reqbuf_free = buf;
+}
+
+static void reqbuf_pool_free(void)
+{
+    char *buf;
+
+    while ((buf = reqbuf_free) != NULL)
+    {
+        memcpy(&reqbuf_free, buf, sizeof(char *));
+        free(buf);
+    }
 }
 
 
@@ -1048,35 +1949,48 @@ static void parse_commandline(const int argc, char *argv[]) {
  */
 static struct connection *new_connection(void)
 {
-    struct connection *conn = xmalloc(sizeof(struct connection));
+    struct connection *conn = conn_alloc();
 
     conn->socket = -1;
+    conn->ev_mask = 0;
+#ifdef HAVE_OPENSSL
+    conn->ssl = NULL;
+    conn->tls_want = 0;
+    conn->ktls = 0;
+#endif
     conn->client = INADDR_ANY;
     conn->last_active = now;
     conn->request = NULL;
     conn->request_length = 0;
+    conn->request_scanned = 0;
+    conn->request_end = 0;
+    conn->pipelined = 0;
     conn->method = NULL;
     conn->uri = NULL;
     conn->referer = NULL;
     conn->user_agent = NULL;
-    conn->range_begin = 0;
-    conn->range_end = 0;
-    conn->range_begin_given = 0;
-    conn->range_end_given = 0;
+    conn->headers = NULL;
+    conn->num_headers = 0;
+    conn->ranges = NULL;
+    conn->num_ranges = 0;
     conn->header = NULL;
     conn->header_length = 0;
     conn->header_sent = 0;
-    conn->header_dont_free = 0;
     conn->header_only = 0;
     conn->http_code = 0;
     conn->conn_close = 1;
     conn->reply = NULL;
-    conn->reply_dont_free = 0;
     conn->reply_fd = -1;
+    conn->file = NULL;
     conn->reply_start = 0;
     conn->reply_length = 0;
     conn->reply_sent = 0;
+    conn->parts = NULL;
+    conn->num_parts = 0;
+    conn->part = 0;
+    conn->part_sent = 0;
     conn->total_sent = 0;
+    memset(&conn->fs, 0, sizeof(conn->fs));
 
     /* Make it harmless so it gets garbage-collected if it should, for some
      * reason, fail to be correctly filled out.
@@ -1087,37 +2001,112 @@ static struct connection *new_connection(void)
 }
 
 
-//Accept a connection from sockin and add it to the connection queue.
+/* ---------------------------------------------------------------------------
+ * Out of descriptors: accept the connection on the reserve descriptor and
+ * close it straight away, rather than leaving it in the backlog where it
+ * would keep waking us up.  Returns 0 if nothing was dropped.
+ */
+static __thread int reserve_fd = -1;
+
+static int reserve_socket(void)
+{
+    int fd = socket(PF_INET, SOCK_DGRAM, 0);
+
+    if (fd != -1) cloexec_fd(fd);
+    return fd;
+}
+
+static int accept_drop(void)
+{
+    int fd;
+
+    if (reserve_fd == -1) return 0;
+    xclose(reserve_fd);
+    fd = accept(sockin, NULL, NULL);
+    if (fd != -1)
+    {
+        xclose(fd);
+        stats->accept_drops++;
+    }
+    /* any descriptor will do */
+    reserve_fd = reserve_socket();
+    return (fd != -1);
+}
+
+
+//Accept up to accept_batch connections from sockin and add them to the
+//connection queue.
 static void accept_connection(void)
 {
     struct sockaddr_in addrin;
     socklen_t sin_size;
     struct connection *conn;
+    int i, fd;
 
-    /* allocate and initialise struct connection */
-    conn = new_connection();
+    stats->accept_wakeups++;
+    for (i=0; i<accept_batch; i++)
+    {
+        sin_size = sizeof(addrin);
+        memset(&addrin, 0, sin_size);
+#ifdef SOCK_NONBLOCK
+        fd = accept4(sockin, (struct sockaddr *)&addrin, &sin_size,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        fd = accept(sockin, (struct sockaddr *)&addrin, &sin_size);
+#endif
+        if (fd == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break; /* backlog is empty */
+            else if (errno == EMFILE || errno == ENFILE)
+            {
+                if (!accept_drop()) break;
+            }
+            else if (errno != ECONNABORTED && errno != EINTR &&
+                errno != EPROTO)
+            {
+                warn("accept()");
+                break;
+            }
+            continue;
+        }
+#ifndef SOCK_NONBLOCK
+        nonblock_socket(fd);
+        cloexec_fd(fd);
+#endif
+        stats->num_accepts++;
 
-    sin_size = sizeof(addrin);
-    memset(&addrin, 0, sin_size);
-    conn->socket = accept(sockin, (struct sockaddr *)&addrin,
-            &sin_size);
-    if (conn->socket == -1) err(1, "accept()");
+        /* allocate and initialise struct connection */
+        conn = new_connection();
+        conn->socket = fd;
+        conn->state = RECV_REQUEST;
+        conn->client = addrin.sin_addr.s_addr;
+        TAILQ_INSERT_TAIL(&connlist, conn, entries);
 
-    nonblock_socket(conn->socket);
+        if (debug)
+        {
+            char ipaddr[INET_ADDRSTRLEN];
+            printf("accepted connection from %s:%u\n",
+                inet_ntop(AF_INET, &addrin.sin_addr, ipaddr, sizeof(ipaddr)),
+                ntohs(addrin.sin_port) );
+        }
 
-    conn->state = RECV_REQUEST;
-    conn->client = addrin.sin_addr.s_addr;
-    LIST_INSERT_HEAD(&connlist, conn, entries);
+#ifdef HAVE_OPENSSL
+        if (tls_ctx != NULL)
+        {
+            tls_accept(conn);
+            finish_poll(conn);
+            continue;
+        }
+#endif
 
-    if (debug) printf("accepted connection from %s:%u\n",
-        inet_ntoa(addrin.sin_addr),
-        ntohs(addrin.sin_port) );
-
-    /* try to read straight away rather than going through another iteration
-     * of the select() loop.
-     */
-    poll_recv_request(conn);
-}
+        /* try to read straight away rather than going through another
+         * iteration of the event loop.
+         */
+        poll_recv_request(conn);
+        finish_poll(conn);
+    }
+}
 
 
 static void log_connection(const struct connection *conn);
@@ -1127,53 +2116,81 @@ static void log_connection(const struct connection *conn);
 static void free_connection(struct connection *conn) {
     if (debug) printf("free_connection(%d)\n", conn->socket);
     log_connection(conn);
-    if (conn->socket != -1) xclose(conn->socket);
-    if (conn->request != NULL) free(conn->request);
-    if (conn->method != NULL) free(conn->method);
-    if (conn->uri != NULL) free(conn->uri);
-    if (conn->referer != NULL) free(conn->referer);
-    if (conn->user_agent != NULL) free(conn->user_agent);
-    if (conn->header != NULL && !conn->header_dont_free)
-        free(conn->header);
-    if (conn->reply != NULL && !conn->reply_dont_free) free(conn->reply);
-    if (conn->reply_fd != -1) xclose(conn->reply_fd);
+    if (conn->socket != -1)
+    {
+        if (conn->ev_mask != 0)
+            (void)ev->set(conn->socket, conn, conn->ev_mask, 0);
+#ifdef HAVE_OPENSSL
+        if (conn->ssl != NULL) tls_close(conn);
+#endif
+        xclose(conn->socket);
+    }
+    if (conn->request != NULL) reqbuf_put(conn->request);
+    if (conn->file != NULL) file_cache_release(conn->file);
+    else if (conn->reply_fd != -1) xclose(conn->reply_fd);
+    free(conn->fs.data); /* if it never made it into the cache */
+    fs_release_sidecars(&conn->fs);
+    arena_reset(&conn->arena);
 }
 
 
 // Recycle a finished connection for HTTP/1.1 Keep-Alive.
 static void recycle_connection(struct connection *conn) {
     int socket_tmp = conn->socket;
+    char *pipelined = NULL;
+    size_t pipelined_length = 0;
+
     if (debug) printf("recycle_connection(%d)\n", socket_tmp);
+
+    /* keep the buffer if the next request has started arriving already */
+    if (conn->request != NULL && conn->request_end < conn->request_length)
+    {
+        pipelined = conn->request;
+        pipelined_length = conn->request_length - conn->request_end;
+        conn->request = NULL;
+    }
     conn->socket = -1; /* so free_connection() doesn't close it */
     free_connection(conn);
     conn->socket = socket_tmp;
 
     /* don't reset conn->client */
-    conn->request = NULL;
-    conn->request_length = 0;
+    conn->request = pipelined;
+    conn->request_length = pipelined_length;
+    if (pipelined != NULL)
+    {
+        memmove(pipelined, pipelined + conn->request_end, pipelined_length);
+        pipelined[pipelined_length] = '\0';
+    }
+    conn->request_scanned = 0;
+    conn->request_end = 0;
+    conn->pipelined = 0;
     conn->method = NULL;
     conn->uri = NULL;
     conn->referer = NULL;
     conn->user_agent = NULL;
-    conn->range_begin = 0;
-    conn->range_end = 0;
-    conn->range_begin_given = 0;
-    conn->range_end_given = 0;
+    conn->headers = NULL;
+    conn->num_headers = 0;
+    conn->ranges = NULL;
+    conn->num_ranges = 0;
     conn->header = NULL;
     conn->header_length = 0;
     conn->header_sent = 0;
-    conn->header_dont_free = 0;
     conn->header_only = 0;
     conn->http_code = 0;
     conn->conn_close = 1;
     conn->reply = NULL;
-    conn->reply_dont_free = 0;
     conn->reply_fd = -1;
+    conn->file = NULL;
     conn->reply_start = 0;
     conn->reply_length = 0;
     conn->reply_sent = 0;
+    conn->parts = NULL;
+    conn->num_parts = 0;
+    conn->part = 0;
+    conn->part_sent = 0;
     conn->total_sent = 0;
-    
+    memset(&conn->fs, 0, sizeof(conn->fs));
+
     conn->state = RECV_REQUEST; /* ready for another */
 }
 
@@ -1189,6 +2206,19 @@ static void strntoupper(char *str, const size_t length)
 
 
 
+/* ---------------------------------------------------------------------------
+ * Mark a connection as active, moving it to the back of connlist.
+ */
+static void touch_connection(struct connection *conn)
+{
+    if (conn->last_active == now) return; /* already in order */
+    conn->last_active = now;
+    TAILQ_REMOVE(&connlist, conn, entries);
+    TAILQ_INSERT_TAIL(&connlist, conn, entries);
+}
+
+
+
 /* ---------------------------------------------------------------------------
  * If a connection has been idle for more than idletime seconds, it will be
  * marked as DONE and killed off in httpd_poll()
@@ -1217,49 +2247,454 @@ static void poll_check_timeout(struct connection *conn)
 static char *rfc1123_date(char *dest, const time_t when)
 {
     time_t when_copy = when;
+    struct tm tm;
     if (strftime(dest, DATE_LEN,
-        "%a, %d %b %Y %H:%M:%S GMT", gmtime(&when_copy) ) == 0)
+        "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&when_copy, &tm) ) == 0)
             errx(1, "strftime() failed [%s]", dest);
     return dest;
 }
 
+/* The Date for replies: formatted once a second per event loop, rather than
+ * once or twice per reply.
+ */
+static __thread char date_cache[DATE_LEN];
+static __thread time_t date_cache_time = -1;
+
+static const char *http_date(void)
+{
+    if (date_cache_time != now)
+    {
+        rfc1123_date(date_cache, now);
+        date_cache_time = now;
+    }
+    return date_cache;
+}
+
 
 
 /* ---------------------------------------------------------------------------
- * Decode URL by converting %XX (where XX are hexadecimal digits) to the
- * character it represents.  Don't forget to free the return value.
+ * File cache.  Remembers what we've worked out about the files we serve,
+ * keyed by path and shared by all the event loops, and forgets the least
+ * recently used files once their fds add up to file_cache_max_fds.  An entry
+ * is only good for as long as the file's identity, size and mtime stay the
+ * same.
+ *
+ * Each entry keeps the file open, so that a request for a cached file needs
+ * no open(), fstat() or close(): connections share the fd, which is fine
+ * since sendfile() and pread() take their own offsets.  Connections hold a
+ * reference while they use an entry, and an entry that's evicted or replaced
+ * while in use is only closed and freed when the last one lets go.
+ *
+ * An entry also holds the precompressed versions of the file that were next
+ * to it when it was made, as entries of their own that only it points to.
+ *
+ * Files up to cache_max_file bytes also have their contents kept, so that
+ * they're sent straight from memory like a generated reply.  Those entries
+ * are on a second LRU list, and the least recently used of them are evicted
+ * to keep the contents within cache_size bytes.
+ *
+ * Entries are trusted for FILE_CACHE_TTL seconds, then a stat() of the path
+ * checks that it's still the same file.  The rest of an entry is the tail of
+ * the response header - Content-Type, ETag, Last-Modified and the blank line
+ * - so that the per-request part is just memcpy()s.
  */
-static char *urldecode(const char *url)
+#define FILE_CACHE_MAX_FDS 1024
+#define FILE_CACHE_BUCKETS 1024 /* power of 2 */
+#define FILE_CACHE_TTL 2
+#define ETAG_LEN 53 /* "inode-size-mtime", up to 16 hex digits each */
+
+struct file_entry
+{
+    /* these change, under file_cache_lock */
+    struct file_entry *hnext;       /* hash chain */
+    TAILQ_ENTRY(file_entry) lru;    /* most recently used last */
+    TAILQ_ENTRY(file_entry) data_lru; /* same, for entries with data */
+    int refs, linked;
+    time_t checked;                 /* when we last knew it was current */
+
+    /* the rest never does, so a reference is enough to read it */
+    char *path;
+    unsigned int hash;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    int fd;
+    char *data;                     /* the contents, or NULL */
+    char lastmod[DATE_LEN];
+    char etag[ETAG_LEN];
+    char *tail;
+    size_t tail_length, validators; /* where Vary/ETag start in tail */
+
+    /* precompressed versions, which aren't in the cache by themselves */
+    struct file_entry *encoded[NUM_ENCODINGS];
+    size_t bytes;                   /* of data, including encoded ones */
+};
+
+static struct file_entry *file_cache[FILE_CACHE_BUCKETS];
+static TAILQ_HEAD(file_lru_head, file_entry) file_lru =
+    { NULL, &file_lru.tqh_first };
+static TAILQ_HEAD(file_data_lru_head, file_entry) file_data_lru =
+    { NULL, &file_data_lru.tqh_first };
+static int file_cache_fds = 0; /* including precompressed versions' */
+static int file_cache_max_fds = FILE_CACHE_MAX_FDS; /* fits RLIMIT_NOFILE */
+static size_t file_cache_bytes = 0; /* of data */
+static pthread_mutex_t file_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_path(const char *path)
+{
+    unsigned int hash = 2166136261u; /* FNV-1a */
+
+    for (; *path != '\0'; path++)
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    return hash;
+}
+
+static int file_entry_valid(const struct file_entry *e, const struct stat *st)
+{
+    return (e->dev == st->st_dev && e->ino == st->st_ino &&
+        e->size == st->st_size && e->mtime == st->st_mtime);
+}
+
+/* How many fds [e] holds open: its own and its precompressed versions'. */
+static int file_entry_fds(const struct file_entry *e)
+{
+    int fds = 1;
+    size_t i;
+
+    for (i=0; i<NUM_ENCODINGS; i++)
+        if (e->encoded[i] != NULL) fds++;
+    return fds;
+}
+
+static void file_entry_free(struct file_entry *e)
+{
+    size_t i;
+
+    for (i=0; i<NUM_ENCODINGS; i++)
+        if (e->encoded[i] != NULL) file_entry_free(e->encoded[i]);
+    xclose(e->fd);
+    free(e->data);
+    free(e->path);
+    free(e->tail);
+    free(e);
+}
+
+/* Take [e] out of the cache, freeing it unless it's still in use. */
+static void file_entry_unlink(struct file_entry *e)
 {
-    size_t i, len = strlen(url);
-    char *out = xmalloc(len+1);
-    int pos;
+    struct file_entry **p = &file_cache[e->hash & (FILE_CACHE_BUCKETS - 1)];
 
-    for (i=0, pos=0; i<len; i++)
+    while (*p != e) p = &(*p)->hnext;
+    *p = e->hnext;
+    TAILQ_REMOVE(&file_lru, e, lru);
+    if (e->bytes > 0)
     {
-        if (url[i] == '%' && i+2 < len &&
-            isxdigit(url[i+1]) && isxdigit(url[i+2]))
-        {
-            /* decode %XX */
-            #define HEX_TO_DIGIT(hex) ( \
-                ((hex) >= 'A' && (hex) <= 'F') ? ((hex)-'A'+10): \
-                ((hex) >= 'a' && (hex) <= 'f') ? ((hex)-'a'+10): \
-                ((hex)-'0') )
+        TAILQ_REMOVE(&file_data_lru, e, data_lru);
+        file_cache_bytes -= e->bytes;
+    }
+    file_cache_fds -= file_entry_fds(e);
+    e->linked = 0;
+    if (e->refs == 0) file_entry_free(e);
+}
+
+/* Find [path]'s entry and mark it most recently used.  Call with
+ * file_cache_lock held.
+ */
+static struct file_entry *file_cache_find(const char *path,
+    const unsigned int hash)
+{
+    struct file_entry *e;
+
+    for (e = file_cache[hash & (FILE_CACHE_BUCKETS - 1)]; e != NULL;
+        e = e->hnext)
+            if (e->hash == hash && strcmp(e->path, path) == 0)
+            {
+                TAILQ_REMOVE(&file_lru, e, lru);
+                TAILQ_INSERT_TAIL(&file_lru, e, lru);
+                if (e->bytes > 0)
+                {
+                    TAILQ_REMOVE(&file_data_lru, e, data_lru);
+                    TAILQ_INSERT_TAIL(&file_data_lru, e, data_lru);
+                }
+                break;
+            }
+    return e;
+}
+
+/* Return a reference to [path]'s entry, or NULL if there isn't one.  Sets
+ * [fresh] if the entry can be used without checking the file first.
+ */
+static struct file_entry *file_cache_lookup(const char *path, int *fresh)
+{
+    struct file_entry *e;
+
+    pthread_mutex_lock(&file_cache_lock);
+    e = file_cache_find(path, hash_path(path));
+    if (e != NULL)
+    {
+        e->refs++;
+        *fresh = (now - e->checked < FILE_CACHE_TTL);
+    }
+    pthread_mutex_unlock(&file_cache_lock);
+    return e;
+}
+
+/* [e] was checked against the file just now and is still current. */
+static void file_cache_checked(struct file_entry *e)
+{
+    pthread_mutex_lock(&file_cache_lock);
+    e->checked = now;
+    pthread_mutex_unlock(&file_cache_lock);
+}
+
+/* Make an entry, without a tail, for a file that's open as [fd]. */
+static struct file_entry *file_entry_new(const struct stat *st, const int fd,
+    char *data)
+{
+    struct file_entry *e = xmalloc(sizeof(struct file_entry));
+
+    memset(e, 0, sizeof(struct file_entry));
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->fd = fd;
+    e->data = data;
+    if (data != NULL) e->bytes = st->st_size;
+    rfc1123_date(e->lastmod, st->st_mtime);
+    snprintf(e->etag, sizeof(e->etag), "\"%llx-%llx-%llx\"",
+        (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+        (unsigned long long)st->st_mtime);
+    return e;
+}
+
+/* Free the contents of [e] and its precompressed versions, before it's in
+ * the cache, leaving the fds to send them from.
+ */
+static void file_entry_drop_data(struct file_entry *e)
+{
+    size_t i;
+
+    for (i=0; i<NUM_ENCODINGS; i++)
+        if (e->encoded[i] != NULL) file_entry_drop_data(e->encoded[i]);
+    free(e->data);
+    e->data = NULL;
+    e->bytes = 0;
+}
+
+/* Give [e] its header tail: the fields describing the file, then the
+ * validators, which a 304 repeats by themselves.
+ */
+static void file_entry_tail(struct file_entry *e, const char *mimetype,
+    const char *encoding, const char *vary)
+{
+    char *type;
+
+    if (encoding != NULL)
+        e->validators = xasprintf(&type,
+            "Content-Type: %s\r\n"
+            "Content-Encoding: %s\r\n", mimetype, encoding);
+    else
+        e->validators = xasprintf(&type, "Content-Type: %s\r\n", mimetype);
+    e->tail_length = xasprintf(&e->tail,
+        "%s"
+        "%s" /* Vary */
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "\r\n", type, vary, e->etag, e->lastmod);
+    free(type);
+}
+
+/* Is [e] for the same file, and precompressed versions, that [fs] found? */
+static int file_entry_matches(const struct file_entry *e,
+    const struct fs_lookup *fs)
+{
+    size_t i;
 
-            out[pos++] = HEX_TO_DIGIT(url[i+1]) * 16 +
-                         HEX_TO_DIGIT(url[i+2]);
-            i += 2;
+    if (!file_entry_valid(e, &fs->st)) return 0;
+    for (i=0; i<NUM_ENCODINGS; i++)
+        if (fs->sidecar[i] == NULL ? e->encoded[i] != NULL :
+            e->encoded[i] == NULL ||
+            !file_entry_valid(e->encoded[i], &fs->sidecar[i]->st))
+                return 0;
+    return 1;
+}
+
+/* Close and free what fs_lookup() found out about precompressed versions. */
+static void fs_release_sidecars(struct fs_lookup *fs)
+{
+    size_t i;
 
-            #undef HEX_TO_DIGIT
+    for (i=0; i<NUM_ENCODINGS; i++)
+        if (fs->sidecar[i] != NULL)
+        {
+            xclose(fs->sidecar[i]->fd);
+            free(fs->sidecar[i]->data);
+            free(fs->sidecar[i]);
+            fs->sidecar[i] = NULL;
         }
-        else
+}
+
+/* Return a reference to the entry for the file fs_lookup() just opened,
+ * making one if it's new.  The entry takes ownership of the fds and data in
+ * [fs], or frees them if it already had the file.
+ */
+static struct file_entry *file_cache_put(struct fs_lookup *fs)
+{
+    const unsigned int hash = hash_path(fs->target);
+    const char *vary = "";
+    struct file_entry *e, *v;
+    size_t i;
+    int fds;
+
+    pthread_mutex_lock(&file_cache_lock);
+    e = file_cache_find(fs->target, hash);
+    if (e != NULL && file_entry_matches(e, fs))
+    {
+        e->refs++;
+        e->checked = now;
+        pthread_mutex_unlock(&file_cache_lock);
+        xclose(fs->fd);
+        free(fs->data);
+        fs->fd = -1;
+        fs->data = NULL;
+        fs_release_sidecars(fs);
+        return e;
+    }
+    if (e != NULL)
+        file_entry_unlink(e);
+
+    e = file_entry_new(&fs->st, fs->fd, fs->data);
+    for (i=0; i<NUM_ENCODINGS; i++)
+        if (fs->sidecar[i] != NULL)
         {
-            /* straight copy */
-            out[pos++] = url[i];
+            v = file_entry_new(&fs->sidecar[i]->st, fs->sidecar[i]->fd,
+                fs->sidecar[i]->data);
+            file_entry_tail(v, fs->mimetype, encodings[i].name,
+                "Vary: Accept-Encoding\r\n");
+            e->encoded[i] = v;
+            e->bytes += v->bytes;
+            free(fs->sidecar[i]);
+            fs->sidecar[i] = NULL;
+            vary = "Vary: Accept-Encoding\r\n";
         }
+    file_entry_tail(e, fs->mimetype, NULL, vary);
+    e->path = xstrdup(fs->target);
+    e->hash = hash;
+    e->refs = 1;
+    e->linked = 1;
+    e->checked = now;
+    fs->fd = -1;
+    fs->data = NULL;
+
+    /* a file and its precompressed versions can add up to more than the
+     * whole budget, in which case they're sent from their fds instead
+     */
+    if (e->bytes > cache_size)
+        file_entry_drop_data(e);
+    while (e->bytes > 0 && file_cache_bytes + e->bytes > cache_size &&
+        !TAILQ_EMPTY(&file_data_lru))
+    {
+        file_entry_unlink(TAILQ_FIRST(&file_data_lru));
+        stats->cache_evictions++;
     }
-    out[pos] = '\0';
-    return (out);
+
+    /* make room for its fds, and its precompressed versions' */
+    fds = file_entry_fds(e);
+    while (file_cache_fds + fds > file_cache_max_fds &&
+        !TAILQ_EMPTY(&file_lru))
+            file_entry_unlink(TAILQ_FIRST(&file_lru));
+
+    e->hnext = file_cache[hash & (FILE_CACHE_BUCKETS - 1)];
+    file_cache[hash & (FILE_CACHE_BUCKETS - 1)] = e;
+    TAILQ_INSERT_TAIL(&file_lru, e, lru);
+    if (e->bytes > 0)
+    {
+        TAILQ_INSERT_TAIL(&file_data_lru, e, data_lru);
+        file_cache_bytes += e->bytes;
+    }
+    file_cache_fds += fds;
+    pthread_mutex_unlock(&file_cache_lock);
+    return e;
+}
+
+static void file_cache_release(struct file_entry *e)
+{
+    pthread_mutex_lock(&file_cache_lock);
+    if (--e->refs == 0 && !e->linked)
+        file_entry_free(e);
+    pthread_mutex_unlock(&file_cache_lock);
+}
+
+/* Keep the cache's fds to a quarter of what we're allowed, and files that
+ * would take up the whole cache out of it.
+ */
+static void file_cache_init(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur / 4 < (rlim_t)file_cache_max_fds)
+            file_cache_max_fds = (int)(rl.rlim_cur / 4);
+    if (file_cache_max_fds < 1 + (int)NUM_ENCODINGS)
+        file_cache_max_fds = 1 + (int)NUM_ENCODINGS;
+    if (cache_max_file > cache_size) cache_max_file = cache_size;
+}
+
+static void file_cache_free(void)
+{
+    while (TAILQ_FIRST(&file_lru) != NULL)
+        file_entry_unlink(TAILQ_FIRST(&file_lru));
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Assemble a reply header for a file from constant pieces and the file's
+ * cached header tail.  [range] is the Content-Range line, or NULL.  A 304
+ * has no Content-Length, so set http_code first.
+ */
+static size_t format_size(char *dest, uintmax_t n)
+{
+    char tmp[24];
+    size_t len = 0, i;
+
+    do tmp[len++] = '0' + (n % 10); while ((n /= 10) != 0);
+    for (i=0; i<len; i++) dest[i] = tmp[len-1-i];
+    return len;
+}
+
+static void file_header(struct connection *conn, const char *status,
+    const char *range, const char *tail, const size_t tail_length)
+{
+    const char *keep = keep_alive(conn);
+    const size_t status_len = strlen(status), keep_len = strlen(keep),
+        range_len = (range == NULL) ? 0 : strlen(range);
+    char *p;
+
+    p = conn->header = arena_alloc(&conn->arena, status_len + 6 + DATE_LEN
+        + server_field_length + keep_len + 16 + 24 + 2 + range_len
+        + tail_length + 1);
+
+    #define PUT(s, len) do { memcpy(p, s, len); p += len; } while (0)
+    PUT(status, status_len);
+    PUT("Date: ", 6);
+    PUT(http_date(), DATE_LEN - 1);
+    PUT("\r\n", 2);
+    PUT(server_field, server_field_length);
+    PUT(keep, keep_len);
+    if (conn->http_code != 304)
+    {
+        PUT("Content-Length: ", 16);
+        p += format_size(p, conn->reply_length);
+        PUT("\r\n", 2);
+    }
+    if (range != NULL) PUT(range, range_len);
+    PUT(tail, tail_length);
+    #undef PUT
+    *p = '\0';
+    conn->header_length = p - conn->header;
 }
 
 
@@ -1270,17 +2705,15 @@ static char *urldecode(const char *url)
 static void default_reply(struct connection *conn,
     const int errcode, const char *errname, const char *format, ...)
 {
-    char *reason, date[DATE_LEN];
+    char *reason;
+    const char *date = http_date();
     va_list va;
 
     va_start(va, format);
-    xvasprintf(&reason, format, va);
+    arena_vasprintf(&conn->arena, &reason, format, va);
     va_end(va);
 
-    /* Only really need to calculate the date once. */
-    rfc1123_date(date, now);
-
-    conn->reply_length = xasprintf(&(conn->reply),
+    conn->reply_length = arena_asprintf(&conn->arena, &(conn->reply),
      "<html><head><title>%d %s</title></head><body>\n"
      "<h1>%s</h1>\n" /* errname */
      "%s\n" /* reason */
@@ -1288,18 +2721,17 @@ static void default_reply(struct connection *conn,
      "Generated by %s on %s\n"
      "</body></html>\n",
      errcode, errname, errname, reason, pkgname, date);
-    free(reason);
 
-    conn->header_length = xasprintf(&(conn->header),
+    conn->header_length = arena_asprintf(&conn->arena, &(conn->header),
      "HTTP/1.1 %d %s\r\n"
      "Date: %s\r\n"
      "Server: %s\r\n"
      "%s" /* keep-alive */
-     "Content-Length: %d\r\n"
+     "Content-Length: %llu\r\n"
      "Content-Type: text/html\r\n"
      "\r\n",
      errcode, errname, date, pkgname, keep_alive(conn),
-     conn->reply_length);
+     (unsigned long long)conn->reply_length);
 
     conn->reply_type = REPLY_GENERATED;
     conn->http_code = errcode;
@@ -1312,17 +2744,15 @@ static void default_reply(struct connection *conn,
  */
 static void redirect(struct connection *conn, const char *format, ...)
 {
-    char *where, date[DATE_LEN];
+    char *where;
+    const char *date = http_date();
     va_list va;
 
     va_start(va, format);
-    xvasprintf(&where, format, va);
+    arena_vasprintf(&conn->arena, &where, format, va);
     va_end(va);
 
-    /* Only really need to calculate the date once. */
-    rfc1123_date(date, now);
-
-    conn->reply_length = xasprintf(&(conn->reply),
+    conn->reply_length = arena_asprintf(&conn->arena, &(conn->reply),
      "<html><head><title>301 Moved Permanently</title></head><body>\n"
      "<h1>Moved Permanently</h1>\n"
      "Moved to: <a href=\"%s\">%s</a>\n" /* where x 2 */
@@ -1331,18 +2761,18 @@ static void redirect(struct connection *conn, const char *format, ...)
      "</body></html>\n",
      where, where, pkgname, date);
 
-    conn->header_length = xasprintf(&(conn->header),
+    conn->header_length = arena_asprintf(&conn->arena, &(conn->header),
      "HTTP/1.1 301 Moved Permanently\r\n"
      "Date: %s\r\n"
      "Server: %s\r\n"
      "Location: %s\r\n"
      "%s" /* keep-alive */
-     "Content-Length: %d\r\n"
+     "Content-Length: %llu\r\n"
      "Content-Type: text/html\r\n"
      "\r\n",
-     date, pkgname, where, keep_alive(conn), conn->reply_length);
+     date, pkgname, where, keep_alive(conn),
+     (unsigned long long)conn->reply_length);
 
-    free(where);
     conn->reply_type = REPLY_GENERATED;
     conn->http_code = 301;
 }
@@ -1350,160 +2780,238 @@ static void redirect(struct connection *conn, const char *format, ...)
 
 
 /* ---------------------------------------------------------------------------
- * Parses a single HTTP request field.  Returns string from end of [field] to
- * first \r, \n or end of request string.  Returns NULL if [field] can't be
- * matched.
+ * Returns the value of the request header [name], matched case-insensitively,
+ * or NULL if it wasn't sent.  The first one wins if it was sent twice.
  *
- * You need to remember to deallocate the result.
- * example: parse_field(conn, "Referer: ");
+ * example: find_header(conn, "Referer");
  */
-static char *parse_field(const struct connection *conn, const char *field)
+static char *find_header(const struct connection *conn, const char *name)
 {
-    size_t bound1, bound2;
-    char *pos;
-
-    /* find start */
-    pos = strstr(conn->request, field);
-    if (pos == NULL) return NULL;
-    bound1 = pos - conn->request + strlen(field);
-
-    /* find end */
-    for (bound2 = bound1;
-        conn->request[bound2] != '\r' &&
-        bound2 < conn->request_length; bound2++)
-            ;
+    const size_t len = strlen(name);
+    int i;
 
-    /* copy to buffer */
-    return split_string(conn->request, bound1, bound2);
+    for (i=0; i<conn->num_headers; i++)
+        if (conn->headers[i].name_length == len &&
+            strcasecmp(conn->headers[i].name, name) == 0)
+                return conn->headers[i].value;
+    return NULL;
 }
 
 
 
 /* ---------------------------------------------------------------------------
- * Parse a Range: field into range_begin and range_end.  Only handles the
- * first range if a list is given.  Sets range_{begin,end}_given to 1 if
- * either part of the range is given.
+ * Parse a Range: field into conn->ranges.  The whole field is ignored, and
+ * the file sent in full, if any of it doesn't parse or it asks for more than
+ * MAX_RANGES ranges.  A range with begin > end is invalid and also makes us
+ * ignore the field.
  */
 static void parse_range_field(struct connection *conn)
 {
-    size_t bound1, bound2, len;
-    char *range;
+    struct byte_range *r;
+    char *range, *end;
 
-    range = parse_field(conn, "Range: bytes=");
-    if (range == NULL) return;
-    len = strlen(range);
+    range = find_header(conn, "Range");
+    if (range == NULL || strncasecmp(range, "bytes=", 6) != 0) return;
+    range += 6;
 
-    do /* break handling */
+    conn->ranges = arena_alloc(&conn->arena,
+        sizeof(struct byte_range) * MAX_RANGES);
+    for (;;)
     {
-        /* parse number up to hyphen */
-        bound1 = 0;
-        for (bound2=0;
-            isdigit( (int)range[bound2] ) && bound2 < len;
-            bound2++)
-                ;
-
-        if (bound2 == len || range[bound2] != '-')
-            break; /* there must be a hyphen here */
+        /* lists can have empty elements */
+        while (*range == ' ' || *range == '\t' || *range == ',') range++;
+        if (*range == '\0')
+        {
+            if (conn->num_ranges > 0) return;
+            break;
+        }
+        if (conn->num_ranges == MAX_RANGES) break; /* too many */
+        r = conn->ranges + conn->num_ranges;
+        memset(r, 0, sizeof(*r));
 
-        if (bound1 != bound2)
+        /* number up to the hyphen */
+        if (isdigit((int)*range))
         {
-            conn->range_begin_given = 1;
-            conn->range_begin = (size_t)strtol(range+bound1, NULL, 10);
+            errno = 0;
+            r->begin = (off_t)strtoll(range, &end, 10);
+            if (errno == ERANGE) break;
+            r->begin_given = 1;
+            range = end;
+        }
+        if (*range++ != '-') break; /* there must be a hyphen here */
 
+        /* number after the hyphen */
+        if (isdigit((int)*range))
+        {
+            errno = 0;
+            r->end = (off_t)strtoll(range, &end, 10);
+            if (errno == ERANGE) break;
+            r->end_given = 1;
+            range = end;
         }
+        if (!r->begin_given && !r->end_given) break;
+        if (r->begin_given && r->end_given && r->begin > r->end) break;
+        conn->num_ranges++;
 
-        /* parse number after hyphen */
-        bound2++;
-        for (bound1=bound2;
-            isdigit( (int)range[bound2] ) && bound2 < len;
-            bound2++)
-                ;
+        /* must be end of string or a list to be valid */
+        while (*range == ' ' || *range == '\t') range++;
+        if (*range != ',' && *range != '\0') break;
+    }
+    conn->num_ranges = 0;
+}
 
-        if (bound2 != len && range[bound2] != ',')
-            break; /* must be end of string or a list to be valid */
+/* ---------------------------------------------------------------------------
+ * Turn conn->ranges into [begin, end] offsets into a file of [size] bytes:
+ * clamp them to the file, and drop the ones that start past its end.  If any
+ * of what's left overlap or touch, sort and coalesce them all, so a long list
+ * of overlapping ranges can't make us send the file many times over.
+ * Returns how many ranges are left.
+ */
+static int resolve_ranges(struct connection *conn, const off_t size)
+{
+    struct byte_range *r = conn->ranges, tmp;
+    int i, j, n = 0, overlap = 0;
 
-        if (bound1 != bound2)
+    for (i=0; i<conn->num_ranges; i++)
+    {
+        if (r[i].begin_given)
+        {
+            /* 100-200, or 100- to the end */
+            if (r[i].begin >= size) continue;
+            if (!r[i].end_given || r[i].end > size - 1)
+                r[i].end = size - 1;
+        }
+        else
         {
-            conn->range_end_given = 1;
-            conn->range_end = (size_t)strtol(range+bound1, NULL, 10);
+            /* -200 :: the last 200 */
+            if (r[i].end == 0 || size == 0) continue;
+            r[i].begin = (r[i].end < size) ? size - r[i].end : 0;
+            r[i].end = size - 1;
         }
+        r[n++] = r[i];
     }
-    while(0); /* break handling */
-    free(range);
 
-    /* sanity check: begin <= end */
-    if (conn->range_begin_given && conn->range_end_given &&
-        (conn->range_begin > conn->range_end))
-    {
-        conn->range_begin_given = conn->range_end_given = 0;
-    }
+    for (i=0; i<n && !overlap; i++)
+        for (j=i+1; j<n && !overlap; j++)
+            overlap = (r[i].begin <= r[j].end + 1 &&
+                r[j].begin <= r[i].end + 1);
+    if (!overlap) return n;
+
+    for (i=1; i<n; i++)
+        for (j=i; j>0 && r[j-1].begin > r[j].begin; j--)
+        {
+            tmp = r[j];
+            r[j] = r[j-1];
+            r[j-1] = tmp;
+        }
+    for (i=0, j=1; j<n; j++)
+        if (r[j].begin <= r[i].end + 1)
+        {
+            if (r[j].end > r[i].end) r[i].end = r[j].end;
+        }
+        else
+            r[++i] = r[j];
+    return i + 1;
 }
 
 
 
+/* ---------------------------------------------------------------------------
+ * Cut the next line out of the request at [*pos], NUL-terminating it in place
+ * (over the \r or \n) and moving [*pos] past it.  Returns NULL at the end of
+ * the request.
+ */
+static char *cut_line(char **pos, char *end, size_t *len)
+{
+    char *line = *pos, *nl;
+
+    if (line >= end) return NULL;
+    nl = memchr(line, '\n', end - line);
+    if (nl == NULL) nl = end; /* (end is the request's terminating NUL) */
+    *pos = (nl < end) ? nl + 1 : end;
+    if (nl > line && nl[-1] == '\r') nl--;
+    *nl = '\0';
+    *len = nl - line;
+    return line;
+}
+
 /* ---------------------------------------------------------------------------
  * Parse an HTTP request like "GET / HTTP/1.1" to get the method (GET), the
- * url (/), the referer (if given) and the user-agent (if given).  Remember to
- * deallocate all these buffers.  The method will be returned in uppercase.
+ * url (/), and index its headers, in one pass over the request.  Everything
+ * is NUL-terminated in place, nothing is copied.  The method will be returned
+ * in uppercase.
  */
 static int parse_request(struct connection *conn)
 {
-    size_t bound1, bound2;
-    char *tmp;
-    assert(conn->request_length == strlen(conn->request));
+    char *pos = conn->request, *end = conn->request + conn->request_end;
+    char *line, *colon, *value, *tmp;
+    size_t len, i;
 
-    /* parse method */
-    for (bound1 = 0; bound1 < conn->request_length &&
-        conn->request[bound1] != ' '; bound1++)
-            ;
+    /* request line: method, uri and protocol, separated by spaces */
+    line = cut_line(&pos, end, &len);
+    if (line == NULL) return 0; /* fail */
 
-    conn->method = split_string(conn->request, 0, bound1);
-    strntoupper(conn->method, bound1);
+    for (i=0; i<len && line[i] != ' '; i++)
+        ;
+    conn->method = line;
+    strntoupper(conn->method, i);
 
-    /* parse uri */
-    for (; bound1 < conn->request_length &&
-        conn->request[bound1] == ' '; bound1++)
-            ;
+    for (; i<len && line[i] == ' '; i++)
+        line[i] = '\0';
+    if (i == len) return 0; /* fail */
 
-    if (bound1 == conn->request_length) return 0; /* fail */
+    conn->uri = line + i;
+    for (; i<len && line[i] != ' '; i++)
+        ;
 
-    for (bound2=bound1+1; bound2 < conn->request_length &&
-        conn->request[bound2] != ' ' &&
-        conn->request[bound2] != '\r'; bound2++)
+    /* parse protocol to determine conn_close */
+    for (; i<len && line[i] == ' '; i++)
+        line[i] = '\0';
+    if (i < len)
+    {
+        char *proto = line + i;
+        for (; i<len && line[i] != ' '; i++)
             ;
+        line[i] = '\0';
+        if (strcasecmp(proto, "HTTP/1.1") == 0) conn->conn_close = 0;
+    }
 
-    conn->uri = split_string(conn->request, bound1, bound2);
-
-    /* parse protocol to determine conn_close */
-    if (conn->request[bound2] == ' ')
+    /* index the headers, up to the blank line */
+    conn->headers = arena_alloc(&conn->arena,
+        sizeof(struct header) * MAX_HEADERS);
+    while ((line = cut_line(&pos, end, &len)) != NULL && len > 0)
     {
-        char *proto;
-        for (bound1 = bound2; bound1 < conn->request_length &&
-            conn->request[bound1] == ' '; bound1++)
-                ;
+        colon = memchr(line, ':', len);
+        if (colon == NULL || colon == line) continue; /* not a header */
+        if (conn->num_headers == MAX_HEADERS) continue;
+        *colon = '\0';
 
-        for (bound2=bound1+1; bound2 < conn->request_length &&
-            conn->request[bound2] != ' ' &&
-            conn->request[bound2] != '\r'; bound2++)
+        /* trim whitespace around the value */
+        for (value = colon + 1; *value == ' ' || *value == '\t'; value++)
+            ;
+        for (tmp = line + len; tmp > value &&
+            (tmp[-1] == ' ' || tmp[-1] == '\t'); tmp--)
                 ;
+        *tmp = '\0';
 
-        proto = split_string(conn->request, bound1, bound2);
-        if (strcasecmp(proto, "HTTP/1.1") == 0) conn->conn_close = 0;
-        free(proto);
+        conn->headers[conn->num_headers].name = line;
+        conn->headers[conn->num_headers].name_length = colon - line;
+        conn->headers[conn->num_headers].value = value;
+        conn->num_headers++;
     }
 
     /* parse connection field */
-    tmp = parse_field(conn, "Connection: ");
+    tmp = find_header(conn, "Connection");
     if (tmp != NULL)
     {
         if (strcasecmp(tmp, "close") == 0) conn->conn_close = 1;
         else if (strcasecmp(tmp, "keep-alive") == 0) conn->conn_close = 0;
-        free(tmp);
     }
+    if (draining) conn->conn_close = 1;
 
     /* parse important fields */
-    conn->referer = parse_field(conn, "Referer: ");
-    conn->user_agent = parse_field(conn, "User-Agent: ");
+    conn->referer = find_header(conn, "Referer");
+    conn->user_agent = find_header(conn, "User-Agent");
     parse_range_field(conn);
     return 1;
 }
@@ -1647,25 +3155,18 @@ static void urlencode_filename( char *name, char *safe_url)
 }
 
 /* ---------------------------------------------------------------------------
- * Generate directory listing.
+ * Generate directory listing from a list made by make_sorted_dirlist().  The
+ * list is deallocated.
  */
-static void generate_dir_listing(struct connection *conn, const char *path)
+static void generate_dir_listing(struct connection *conn,
+    struct dlent **list, const ssize_t listsize)
 {
-    char date[DATE_LEN], *spaces;
-    struct dlent **list;
-    ssize_t listsize;
+    const char *date = http_date();
+    char *spaces;
     size_t maxlen = 0;
     int i;
     struct apbuf *listing = make_apbuf();
 
-    listsize = make_sorted_dirlist(path, &list);
-    if (listsize == -1)
-    {
-        default_reply(conn, 500, "Internal Server Error",
-            "Couldn't list directory: %s", strerror(errno));
-        return;
-    }
-
     for (i=0; i<listsize; i++)
     {
         size_t tmp = strlen(list[i]->name);
@@ -1701,7 +3202,8 @@ static void generate_dir_listing(struct connection *conn, const char *path)
         else
         {
             appendl(listing, spaces, maxlen-strlen(list[i]->name));
-            appendf(listing, "%10d\n", list[i]->size);
+            appendf(listing, "%10llu\n",
+                (unsigned long long)list[i]->size);
         }
     }
 
@@ -1709,7 +3211,6 @@ static void generate_dir_listing(struct connection *conn, const char *path)
     free(list);
     free(spaces);
 
-    rfc1123_date(date, now);
     append(listing,
      "</pre></tt>\n"
      "<hr>\n"
@@ -1719,19 +3220,21 @@ static void generate_dir_listing(struct connection *conn, const char *path)
     append(listing, date);
     append(listing, "\n</body>\n</html>\n");
 
-    conn->reply = listing->str;
+    conn->reply = arena_strndup(&conn->arena, listing->str, listing->length);
     conn->reply_length = listing->length;
-    free(listing); /* don't free inside of listing */
+    free(listing->str);
+    free(listing);
 
-    conn->header_length = xasprintf(&(conn->header),
+    conn->header_length = arena_asprintf(&conn->arena, &(conn->header),
      "HTTP/1.1 200 OK\r\n"
      "Date: %s\r\n"
      "Server: %s\r\n"
      "%s" /* keep-alive */
-     "Content-Length: %u\r\n"
+     "Content-Length: %llu\r\n"
      "Content-Type: text/html\r\n"
      "\r\n",
-     date, pkgname, keep_alive(conn), conn->reply_length);
+     date, pkgname, keep_alive(conn),
+     (unsigned long long)conn->reply_length);
 
     conn->reply_type = REPLY_GENERATED;
     conn->http_code = 200;
@@ -1740,192 +3243,762 @@ static void generate_dir_listing(struct connection *conn, const char *path)
 
 
 /* ---------------------------------------------------------------------------
- * Process a GET/HEAD request
+ * Read in a file that's small enough for the file cache to keep in memory.
+ * Returns NULL if it's too big, or if it changed under us, in which case it's
+ * sent from the file instead.
  */
-static void process_get(struct connection *conn)
+static char *read_small_file(const int fd, const struct stat *st)
 {
-    char *decoded_url, *target, *if_mod_since;
-    char date[DATE_LEN], lastmod[DATE_LEN];
-    const char *mimetype = NULL;
-    struct stat filestat;
-
-    /* work out path of file being requested */
-    decoded_url = urldecode(conn->uri);
-
-    /* make sure it's safe */
-    if (make_safe_uri(decoded_url) == NULL) {
-        default_reply(conn, 400, "Bad Request",
-            "You requested an invalid URI: %s", conn->uri);
-        free(decoded_url);
-        return;
-    }
+    char *data;
 
-    /* does it end in a slash? serve up url/index_name */
-    if (decoded_url[strlen(decoded_url)-1] == '/')
-    {
-        xasprintf(&target, "%s%s%s", wwwroot, decoded_url, index_name);
-        if (!file_exists(target))
-        {
-            free(target);
-            xasprintf(&target, "%s%s", wwwroot, decoded_url);
-            generate_dir_listing(conn, target);
-            free(target);
-            free(decoded_url);
-            return;
-        }
-        mimetype = uri_content_type(index_name);
-    }
-    else /* points to a file */
+    if (st->st_size == 0 || (size_t)st->st_size > cache_max_file)
+        return NULL;
+    data = xmalloc(st->st_size);
+    if (pread(fd, data, st->st_size, 0) != st->st_size)
     {
-        xasprintf(&target, "%s%s", wwwroot, decoded_url);
-        mimetype = uri_content_type(decoded_url);
+        free(data);
+        return NULL;
     }
-    free(decoded_url);
-    if (debug) printf("uri=%s, target=%s, content-type=%s\n",
-        conn->uri, target, mimetype);
+    return data;
+}
 
-    /* open file */
-    conn->reply_fd = open(target, O_RDONLY | O_NONBLOCK);
-    free(target);
 
-    if (conn->reply_fd == -1)
-    {
-        /* open() failed */
-        if (errno == EACCES)
-            default_reply(conn, 403, "Forbidden",
-                "You don't have permission to access (%s).", conn->uri);
-        else if (errno == ENOENT)
-            default_reply(conn, 404, "Not Found",
-                "The URI you requested (%s) was not found.", conn->uri);
-        else
-            default_reply(conn, 500, "Internal Server Error",
-                "The URI you requested (%s) cannot be returned: %s.",
-                conn->uri, strerror(errno));
 
-        return;
-    }
+/* ---------------------------------------------------------------------------
+ * Do the blocking filesystem work for a GET/HEAD request: open and fstat() the
+ * target and its precompressed versions, or list the directory if there's no
+ * index file.  This only touches [fs] and the read-only part of [fs->cached],
+ * so that it can run on an fs worker thread.
+ */
+static void fs_lookup(struct fs_lookup *fs)
+{
+    const size_t len = strlen(fs->target);
+    struct stat st;
+    size_t i;
+    int fd;
 
-    /* stat the file */
-    if (fstat(conn->reply_fd, &filestat) == -1)
-    {
-        default_reply(conn, 500, "Internal Server Error",
-            "fstat() failed: %s.", strerror(errno));
-        return;
-    }
+    fs->fd = -1;
+    fs->error = 0;
+    fs->data = NULL;
+    fs->listing = 0;
 
-    /* make sure it's a regular file */
-    if (S_ISDIR(filestat.st_mode))
+    /* with a cached entry, stat()s will tell us whether we can keep using
+     * it and its precompressed versions, and fd stays -1 if we can
+     */
+    if (fs->cached != NULL && stat(fs->target, &fs->st) == 0 &&
+        file_entry_valid(fs->cached, &fs->st))
     {
-        redirect(conn, "%s/", conn->uri);
-        return;
+        for (i=0; i<NUM_ENCODINGS; i++)
+        {
+            const struct file_entry *v = fs->cached->encoded[i];
+            int found;
+
+            strcpy(fs->target + len, encodings[i].suffix);
+            found = (stat(fs->target, &st) == 0 && S_ISREG(st.st_mode));
+            fs->target[len] = '\0';
+            if (found != (v != NULL) || (found && !file_entry_valid(v, &st)))
+                break;
+        }
+        if (i == NUM_ENCODINGS) return;
     }
-    else if (!S_ISREG(filestat.st_mode))
+
+    if (fs->dir != NULL && !file_exists(fs->target))
     {
-        default_reply(conn, 403, "Forbidden", "Not a regular file.");
+        fs->listing = 1;
+        fs->listsize = make_sorted_dirlist(fs->dir, &fs->list);
+        if (fs->listsize == -1) fs->error = errno;
         return;
     }
 
-    conn->reply_type = REPLY_FROMFILE;
-    (void) rfc1123_date(lastmod, filestat.st_mtime);
-
-    /* check for If-Modified-Since, may not have to send */
-    if_mod_since = parse_field(conn, "If-Modified-Since: ");
-    if (if_mod_since != NULL &&
-        strcmp(if_mod_since, lastmod) == 0)
+    fs->fd = open(fs->target, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fs->fd == -1 || fstat(fs->fd, &fs->st) == -1)
     {
-        if (debug) printf("not modified since %s\n", if_mod_since);
-        default_reply(conn, 304, "Not Modified", "");
-        conn->header_only = 1;
-        free(if_mod_since);
+        fs->error = errno;
         return;
     }
-    free(if_mod_since);
+    if (!S_ISREG(fs->st.st_mode)) return;
+    fs->data = read_small_file(fs->fd, &fs->st);
 
-    if (conn->range_begin_given || conn->range_end_given)
+    /* and whichever precompressed versions are next to it */
+    for (i=0; i<NUM_ENCODINGS; i++)
     {
-        size_t from, to;
-
-        if (conn->range_begin_given && conn->range_end_given)
-        {
-            /* 100-200 */
-            from = conn->range_begin;
-            to = conn->range_end;
-
-            /* clamp [to] to filestat.st_size-1 */
-            if (to > (size_t)(filestat.st_size-1))
-                to = filestat.st_size-1;
-        }
-        else if (conn->range_begin_given && !conn->range_end_given)
+        strcpy(fs->target + len, encodings[i].suffix);
+        fd = open(fs->target, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        fs->target[len] = '\0';
+        if (fd == -1) continue;
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
         {
-            /* 100- :: yields 100 to end */
-            from = conn->range_begin;
-            to = filestat.st_size-1;
+            xclose(fd);
+            continue;
         }
-        else if (!conn->range_begin_given && conn->range_end_given)
-        {
-            /* -200 :: yields last 200 */
-            to = filestat.st_size-1;
-            from = to - conn->range_end + 1;
+        fs->sidecar[i] = xmalloc(sizeof(struct fs_sidecar));
+        fs->sidecar[i]->fd = fd;
+        fs->sidecar[i]->st = st;
+        fs->sidecar[i]->data = read_small_file(fd, &st);
+    }
+}
 
-            /* check for wrapping */
-            if (from > to) from = 0;
-        }
-        else errx(1, "internal error - from/to mismatch");
+
+
+/* ---------------------------------------------------------------------------
+ * Filesystem worker pool.  A cold cache or a network filesystem can make
+ * fs_lookup() block for a long time, so with --fs-threads the lookups are
+ * handed to a pool of threads instead of stalling the event loop.  The
+ * connection is parked in WAIT_FS, outside of connlist, and the event loop
+ * is woken through its wake channel when the lookup is done.
+ */
+static pthread_t *fs_pool = NULL;
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fs_cond = PTHREAD_COND_INITIALIZER;
+static struct connection *fs_queue = NULL, **fs_queue_tail = &fs_queue;
+static int fs_stopping = 0;
+
+/* Finished lookups waiting for their event loop. */
+struct fs_done_queue
+{
+    pthread_mutex_t lock;
+    struct connection *head;
+    int wake_fd;
+};
+static __thread struct fs_done_queue fs_done;
+static __thread int fs_pending = 0; /* connections in WAIT_FS */
+
+static void *fs_worker(void *arg)
+{
+    struct connection *conn;
+    struct fs_done_queue *done;
+    int was_empty;
+
+    (void)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&fs_lock);
+        while (fs_queue == NULL && !fs_stopping)
+            pthread_cond_wait(&fs_cond, &fs_lock);
+        conn = fs_queue;
+        if (conn != NULL)
+        {
+            fs_queue = conn->fs.next;
+            if (fs_queue == NULL) fs_queue_tail = &fs_queue;
+        }
+        pthread_mutex_unlock(&fs_lock);
+        if (conn == NULL) break; /* stopping */
+
+        fs_lookup(&conn->fs);
+
+        /* hand it back, only waking the loop if it isn't awake already */
+        done = conn->fs.owner;
+        pthread_mutex_lock(&done->lock);
+        was_empty = (done->head == NULL);
+        conn->fs.next = done->head;
+        done->head = conn;
+        pthread_mutex_unlock(&done->lock);
+        if (was_empty) wake_loop(done->wake_fd);
+    }
+    return NULL;
+}
+
+static void fs_pool_start(void)
+{
+    int i, error;
+
+    if (fs_threads == 0) return;
+    fs_pool = xmalloc(sizeof(pthread_t) * fs_threads);
+    for (i=0; i<fs_threads; i++)
+    {
+        error = pthread_create(&fs_pool[i], NULL, fs_worker, NULL);
+        if (error != 0)
+        {
+            errno = error;
+            err(1, "pthread_create(fs worker)");
+        }
+    }
+}
+
+static void fs_pool_stop(void)
+{
+    int i;
+
+    if (fs_threads == 0) return;
+    pthread_mutex_lock(&fs_lock);
+    fs_stopping = 1;
+    pthread_cond_broadcast(&fs_cond);
+    pthread_mutex_unlock(&fs_lock);
+    for (i=0; i<fs_threads; i++)
+        pthread_join(fs_pool[i], NULL);
+    free(fs_pool);
+}
+
+/* Park a connection until its lookup is done. */
+static void fs_submit(struct connection *conn)
+{
+    conn->state = WAIT_FS;
+    TAILQ_REMOVE(&connlist, conn, entries);
+    fs_pending++;
+    conn->fs.owner = &fs_done;
+    conn->fs.next = NULL;
+
+    pthread_mutex_lock(&fs_lock);
+    *fs_queue_tail = conn;
+    fs_queue_tail = &conn->fs.next;
+    pthread_cond_signal(&fs_cond);
+    pthread_mutex_unlock(&fs_lock);
+}
+
+static void process_get_reply(struct connection *conn);
+
+/* Pick up this loop's finished lookups and start sending their replies. */
+static void fs_complete(void)
+{
+    struct connection *conn, *next;
+
+    pthread_mutex_lock(&fs_done.lock);
+    conn = fs_done.head;
+    fs_done.head = NULL;
+    pthread_mutex_unlock(&fs_done.lock);
+
+    for (; conn != NULL; conn = next)
+    {
+        next = conn->fs.next;
+        fs_pending--;
+        conn->last_active = now;
+        TAILQ_INSERT_TAIL(&connlist, conn, entries);
+
+        process_get_reply(conn);
+        conn->state = SEND_HEADER;
+        poll_send_header(conn);
+        finish_poll(conn);
+    }
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Process a GET/HEAD request: work out which file it's for, and look that up
+ * either straight away or on the fs worker pool.
+ */
+static void process_get(struct connection *conn)
+{
+    const size_t rootlen = strlen(wwwroot), indexlen = strlen(index_name);
+    size_t ext;
+    ssize_t len;
+    char *path;
+    int fresh;
+
+    /* work out path of file being requested, and make sure it's safe */
+    conn->fs.target = arena_alloc(&conn->arena,
+        rootlen + strlen(conn->uri) + indexlen + ENCODING_SUFFIX_MAX + 1);
+    memcpy(conn->fs.target, wwwroot, rootlen);
+    path = conn->fs.target + rootlen;
+    len = resolve_uri(path, conn->uri, &ext);
+    if (len == -1) {
+        default_reply(conn, 400, "Bad Request",
+            "You requested an invalid URI: %s", conn->uri);
+        return;
+    }
+
+    /* does it end in a slash? serve up url/index_name */
+    if (path[len-1] == '/')
+    {
+        conn->fs.dir = arena_strndup(&conn->arena, conn->fs.target,
+            rootlen + len);
+        memcpy(path + len, index_name, indexlen + 1);
+        conn->fs.mimetype = uri_content_type(index_name);
+    }
+    else /* points to a file */
+        conn->fs.mimetype =
+            (ext != 0) ? ext_content_type(path + ext) : default_mimetype;
+    if (debug) printf("uri=%s, target=%s, content-type=%s\n",
+        conn->uri, conn->fs.target, conn->fs.mimetype);
+
+    /* a recently checked cache entry needs no filesystem work at all */
+    conn->file = file_cache_lookup(conn->fs.target, &fresh);
+    if (conn->file != NULL)
+    {
+        if (fresh)
+        {
+            conn->fs.fd = -1;
+            process_get_reply(conn);
+            return;
+        }
+        conn->fs.cached = conn->file;
+    }
+
+    if (fs_threads > 0)
+        fs_submit(conn);
+    else
+    {
+        fs_lookup(&conn->fs);
+        process_get_reply(conn);
+    }
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Parse a q-value into thousandths.
+ */
+static int parse_qvalue(const char *q)
+{
+    int value = 0, scale;
+
+    if (*q != '0') return 1000; /* 1, 1.0 or nonsense */
+    if (q[1] == '.')
+        for (q += 2, scale = 100; scale > 0 && isdigit((int)*q);
+            q++, scale /= 10)
+                value += (*q - '0') * scale;
+    return value;
+}
+
+/* ---------------------------------------------------------------------------
+ * Pick the precompressed version of [e] to send: out of the ones the client
+ * accepts, the one with the highest q-value.  Returns -1 to send the file as
+ * it is.
+ */
+static int choose_encoding(const struct connection *conn,
+    const struct file_entry *e)
+{
+    int q[NUM_ENCODINGS], star = 0, best = -1, best_q = 0;
+    const char *field, *name;
+    size_t i, len;
+
+    for (i=0; i<NUM_ENCODINGS && e->encoded[i] == NULL; i++)
+        ;
+    if (i == NUM_ENCODINGS) return -1; /* nothing to choose from */
+    field = find_header(conn, "Accept-Encoding");
+    if (field == NULL) return -1;
+
+    for (i=0; i<NUM_ENCODINGS; i++) q[i] = -1; /* not mentioned */
+    while (*field != '\0')
+    {
+        int value = 1000;
+
+        while (*field == ' ' || *field == '\t' || *field == ',') field++;
+        name = field;
+        while (*field != '\0' && *field != ',' && *field != ';' &&
+            *field != ' ' && *field != '\t') field++;
+        len = field - name;
+
+        /* parameters, of which only q matters */
+        while (*field != '\0' && *field != ',')
+            if (*field++ == ';')
+            {
+                while (*field == ' ' || *field == '\t') field++;
+                if ((*field == 'q' || *field == 'Q') && field[1] == '=')
+                    value = parse_qvalue(field + 2);
+            }
+
+        if (len == 1 && *name == '*')
+            star = value;
+        else
+            for (i=0; i<NUM_ENCODINGS; i++)
+                if (strlen(encodings[i].name) == len &&
+                    strncasecmp(name, encodings[i].name, len) == 0)
+                        q[i] = value;
+    }
+
+    for (i=0; i<NUM_ENCODINGS; i++)
+    {
+        const int value = (q[i] == -1) ? star : q[i];
+
+        if (e->encoded[i] != NULL && value > best_q)
+        {
+            best = (int)i;
+            best_q = value;
+        }
+    }
+    return best;
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Parse an HTTP-date in any of the three formats RFC 7231 says we have to
+ * accept:
+ *
+ *   Sun, 06 Nov 1994 08:49:37 GMT    (IMF-fixdate)
+ *   Sunday, 06-Nov-94 08:49:37 GMT   (RFC 850)
+ *   Sun Nov  6 08:49:37 1994         (asctime)
+ *
+ * Returns 0 if [date] isn't one of them.
+ */
+static int parse_http_date(const char *date, time_t *when)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char *p = strchr(date, ' '), *m;
+    char mon[4], zone[4];
+    int year, day, hour, min, sec, y, mp;
+    long days;
+
+    if (p == NULL || p == date) return 0;
+    if (p[-1] == ',')
+    {
+        if (sscanf(p, " %2d %3s %4d %2d:%2d:%2d %3s",
+                &day, mon, &year, &hour, &min, &sec, zone) == 7)
+            ;
+        else if (sscanf(p, " %2d-%3s-%2d %2d:%2d:%2d %3s",
+                &day, mon, &year, &hour, &min, &sec, zone) == 7)
+            year += (year < 70) ? 2000 : 1900;
+        else
+            return 0;
+        if (strcmp(zone, "GMT") != 0) return 0;
+    }
+    else if (sscanf(p, " %3s %2d %2d:%2d:%2d %4d",
+            mon, &day, &hour, &min, &sec, &year) != 6)
+        return 0;
+
+    m = (strlen(mon) == 3) ? strstr(months, mon) : NULL;
+    if (m == NULL || (m - months) % 3 != 0 || year < 1970 ||
+        day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+            return 0;
+
+    /* days since the epoch, counting years from March so that the leap
+     * day comes last
+     */
+    mp = ((int)(m - months) / 3 + 10) % 12;
+    y = year - (mp >= 10);
+    days = 365L * y + y/4 - y/100 + y/400 + (153 * mp + 2) / 5 + day - 1
+        - 719468L;
+    *when = (time_t)days * 86400 + hour * 3600 + min * 60 + sec;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Is [etag] in the comma-separated list of entity-tags [list]?  [weak] allows
+ * W/ tags to match, otherwise they never do.
+ */
+static int etag_listed(const char *list, const char *etag, const int weak)
+{
+    const size_t len = strlen(etag);
+    int is_weak;
+
+    for (;;)
+    {
+        while (*list == ' ' || *list == '\t' || *list == ',') list++;
+        if (*list == '\0') return 0;
+        if (*list == '*') return 1;
+
+        is_weak = (list[0] == 'W' && list[1] == '/');
+        if (is_weak) list += 2;
+        if ((weak || !is_weak) && strncmp(list, etag, len) == 0 &&
+            (list[len] == '\0' || list[len] == ',' || list[len] == ' ' ||
+             list[len] == '\t'))
+                return 1;
+
+        /* skip the rest of this one, commas can be quoted */
+        if (*list == '"')
+            for (list++; *list != '\0' && *list != '"'; list++)
+                ;
+        while (*list != '\0' && *list != ',') list++;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Check a GET/HEAD's validators against the file: returns 0 if the client's
+ * copy is current and it gets a 304.  If-None-Match takes precedence over
+ * If-Modified-Since, which is ignored if it isn't a date.
+ */
+static int modified_since(const struct connection *conn,
+    const struct file_entry *e)
+{
+    const char *field;
+    time_t since;
+
+    field = find_header(conn, "If-None-Match");
+    if (field != NULL)
+        return !etag_listed(field, e->etag, 1);
+
+    field = find_header(conn, "If-Modified-Since");
+    if (field != NULL && parse_http_date(field, &since) && e->mtime <= since)
+    {
+        if (debug) printf("not modified since %s\n", field);
+        return 0;
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Does If-Range, if there is one, let a Range request go ahead?  It has to
+ * name exactly this version of the file - by strong ETag or Last-Modified -
+ * otherwise the client gets the whole file instead.
+ */
+static int if_range_matches(const struct connection *conn,
+    const struct file_entry *e)
+{
+    const char *field = find_header(conn, "If-Range");
+    time_t when;
+
+    if (field == NULL) return 1;
+    if (field[0] == '"' || (field[0] == 'W' && field[1] == '/'))
+        return (strcmp(field, e->etag) == 0);
+    return (parse_http_date(field, &when) && when == e->mtime);
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Put the file fs_lookup() opened in the file cache, or reply with an error
+ * if it can't be served.  Returns 0 if there was an error.
+ */
+static int reply_file_entry(struct connection *conn)
+{
+    /* the reply owns the fd until the cache takes it */
+    conn->reply_fd = conn->fs.fd;
+
+    if (conn->reply_fd == -1)
+    {
+        /* open() failed */
+        if (conn->fs.error == EACCES)
+            default_reply(conn, 403, "Forbidden",
+                "You don't have permission to access (%s).", conn->uri);
+        else if (conn->fs.error == ENOENT)
+            default_reply(conn, 404, "Not Found",
+                "The URI you requested (%s) was not found.", conn->uri);
+        else
+            default_reply(conn, 500, "Internal Server Error",
+                "The URI you requested (%s) cannot be returned: %s.",
+                conn->uri, strerror(conn->fs.error));
+
+        return 0;
+    }
+
+    /* did we manage to stat the file? */
+    if (conn->fs.error != 0)
+    {
+        default_reply(conn, 500, "Internal Server Error",
+            "fstat() failed: %s.", strerror(conn->fs.error));
+        return 0;
+    }
+
+    /* make sure it's a regular file */
+    if (S_ISDIR(conn->fs.st.st_mode))
+    {
+        redirect(conn, "%s/", conn->uri);
+        return 0;
+    }
+    else if (!S_ISREG(conn->fs.st.st_mode))
+    {
+        default_reply(conn, 403, "Forbidden", "Not a regular file.");
+        return 0;
+    }
+
+    conn->file = file_cache_put(&conn->fs);
+    return 1;
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Build a multipart/byteranges reply for the ranges in conn->ranges.  Each
+ * part is its header from memory followed by a slice of the file, and a last
+ * part with no slice closes the body.
+ */
+static void multipart_reply(struct connection *conn,
+    const struct file_entry *e)
+{
+    const size_t type_length = strstr(e->tail, "\r\n") - e->tail;
+    struct reply_part *part;
+    char *content_type;
+    int i;
+
+    conn->num_parts = conn->num_ranges + 1;
+    conn->parts = arena_alloc(&conn->arena,
+        sizeof(struct reply_part) * conn->num_parts);
+    conn->reply_length = 0;
+    for (i=0; i<conn->num_parts; i++)
+    {
+        part = conn->parts + i;
+        if (i < conn->num_ranges)
+        {
+            part->header_length = arena_asprintf(&conn->arena,
+                &part->header,
+                "\r\n--%s\r\n"
+                "%.*s\r\n" /* Content-Type */
+                "Content-Range: bytes %llu-%llu/%llu\r\n"
+                "\r\n", boundary, (int)type_length, e->tail,
+                (unsigned long long)conn->ranges[i].begin,
+                (unsigned long long)conn->ranges[i].end,
+                (unsigned long long)e->size);
+            part->offset = conn->ranges[i].begin;
+            part->length =
+                conn->ranges[i].end - conn->ranges[i].begin + 1;
+        }
+        else
+        {
+            part->header_length = arena_asprintf(&conn->arena,
+                &part->header, "\r\n--%s--\r\n", boundary);
+            part->offset = 0;
+            part->length = 0;
+        }
+        conn->reply_length += part->header_length + part->length;
+    }
+
+    arena_asprintf(&conn->arena, &content_type,
+        "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+    file_header(conn, "HTTP/1.1 206 Partial Content\r\n", content_type,
+        e->tail + e->validators, e->tail_length - e->validators);
+    conn->reply_type = REPLY_MULTIPART;
+    conn->http_code = 206;
+    if (debug) printf("sending %d ranges\n", conn->num_ranges);
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Build the reply to a GET/HEAD request once its fs_lookup() is done.
+ */
+static void process_get_reply(struct connection *conn)
+{
+    char *range;
+    const struct file_entry *e;
+    int enc, modified, from_cache = 0;
+
+    if (conn->fs.listing)
+    {
+        if (conn->fs.listsize == -1)
+            default_reply(conn, 500, "Internal Server Error",
+                "Couldn't list directory: %s", strerror(conn->fs.error));
+        else
+            generate_dir_listing(conn, conn->fs.list, conn->fs.listsize);
+        return;
+    }
+
+    if (conn->file != NULL && conn->fs.fd == -1 && conn->fs.error == 0)
+    {
+        /* the cached entry is still current */
+        if (conn->fs.cached != NULL) file_cache_checked(conn->file);
+        from_cache = 1;
+    }
+    else
+    {
+        if (conn->file != NULL)
+        {
+            /* the file changed under its entry */
+            file_cache_release(conn->file);
+            conn->file = NULL;
+        }
+        if (!reply_file_entry(conn)) return;
+    }
+
+    /* the rest of the header comes from the cache, and so does the body:
+     * from memory if we have it, otherwise from the shared fd
+     */
+    e = conn->file;
+    enc = (conn->num_ranges > 1) ? -1 : choose_encoding(conn, e);
+    if (enc != -1)
+    {
+        if (debug) printf("sending %s version\n", encodings[enc].name);
+        e = e->encoded[enc];
+    }
+    conn->reply_fd = e->fd;
+    conn->reply_type = REPLY_FROMFILE;
+
+    /* it's a hit if an entry we already had answers the request by itself:
+     * a 304, or the contents from memory
+     */
+    modified = modified_since(conn, e);
+    if (from_cache && (!modified || e->data != NULL))
+        stats->cache_hits++;
+    else
+        stats->cache_misses++;
+
+    /* conditional requests are answered from the entry alone */
+    if (!modified)
+    {
+        conn->http_code = 304;
+        file_header(conn, "HTTP/1.1 304 Not Modified\r\n", NULL,
+            e->tail + e->validators, e->tail_length - e->validators);
+        conn->header_only = 1;
+        return;
+    }
+    if (conn->num_ranges > 0 && !if_range_matches(conn, e))
+        conn->num_ranges = 0;
+
+    if (e->data != NULL)
+    {
+        conn->reply = e->data;
+        conn->reply_type = REPLY_GENERATED;
+    }
+
+    if (conn->num_ranges > 0)
+    {
+        conn->num_ranges = resolve_ranges(conn, e->size);
+        if (conn->num_ranges == 0)
+        {
+            /* none of them are in the file */
+            arena_asprintf(&conn->arena, &range,
+                "Content-Range: bytes */%llu\r\n",
+                (unsigned long long)e->size);
+            conn->reply_length = 0;
+            file_header(conn, "HTTP/1.1 416 Range Not Satisfiable\r\n",
+                range, e->tail, e->tail_length);
+            conn->http_code = 416;
+            conn->header_only = 1;
+            return;
+        }
+    }
+
+    if (conn->num_ranges > 1)
+        multipart_reply(conn, e);
+    else if (conn->num_ranges == 1)
+    {
+        const off_t from = conn->ranges[0].begin, to = conn->ranges[0].end;
 
         conn->reply_start = from;
         conn->reply_length = to - from + 1;
 
-        conn->header_length = xasprintf(&(conn->header),
-            "HTTP/1.1 206 Partial Content\r\n"
-            "Date: %s\r\n"
-            "Server: %s\r\n"
-            "%s" /* keep-alive */
-            "Content-Length: %d\r\n"
-            "Content-Range: bytes %d-%d/%d\r\n"
-            "Content-Type: %s\r\n"
-            "Last-Modified: %s\r\n"
-            "\r\n"
-            ,
-            rfc1123_date(date, now), pkgname, keep_alive(conn),
-            conn->reply_length, from, to, filestat.st_size,
-            mimetype, lastmod
-        );
+        arena_asprintf(&conn->arena, &range,
+            "Content-Range: bytes %llu-%llu/%llu\r\n",
+            (unsigned long long)from, (unsigned long long)to,
+            (unsigned long long)e->size);
+        file_header(conn, "HTTP/1.1 206 Partial Content\r\n", range,
+            e->tail, e->tail_length);
         conn->http_code = 206;
-        if (debug) printf("sending %u-%u/%u\n",
-            (unsigned int)from, (unsigned int)to,
-            (unsigned int)filestat.st_size);
+        if (debug) printf("sending %llu-%llu/%llu\n",
+            (unsigned long long)from, (unsigned long long)to,
+            (unsigned long long)e->size);
     }
     else /* no range stuff */
     {
-        conn->reply_length = filestat.st_size;
+        conn->reply_length = e->size;
 
-        conn->header_length = xasprintf(&(conn->header),
-            "HTTP/1.1 200 OK\r\n"
-            "Date: %s\r\n"
-            "Server: %s\r\n"
-            "%s" /* keep-alive */
-            "Content-Length: %d\r\n"
-            "Content-Type: %s\r\n"
-            "Last-Modified: %s\r\n"
-            "\r\n"
-            ,
-            rfc1123_date(date, now), pkgname, keep_alive(conn),
-            conn->reply_length, mimetype, lastmod
-        );
+        file_header(conn, "HTTP/1.1 200 OK\r\n", NULL, e->tail, e->tail_length);
         conn->http_code = 200;
     }
 }
 
 
 
+/* ---------------------------------------------------------------------------
+ * Does the request have a body?  Content-Length: 0 doesn't count, some
+ * clients send it with every GET.
+ */
+static int request_has_body(const struct connection *conn)
+{
+    const char *length = find_header(conn, "Content-Length");
+
+    if (find_header(conn, "Transfer-Encoding") != NULL) return 1;
+    if (length == NULL) return 0;
+    /* anything but a string of zeros, even if it isn't a number */
+    return (*length == '\0' || length[strspn(length, "0")] != '\0');
+}
+
 /* ---------------------------------------------------------------------------
  * Process a request: build the header and reply, advance state.
  */
 static void process_request(struct connection *conn)
 {
-    num_requests++;
-    if (!parse_request(conn))
+    const int parsed = parse_request(conn);
+
+    /* we don't read request bodies, so after one we can't tell where the
+     * next request starts
+     */
+    if (parsed && request_has_body(conn)) conn->conn_close = 1;
+
+    stats->num_requests++;
+    if (!parsed)
     {
+        conn->conn_close = 1; /* can't tell where the next one starts */
         default_reply(conn, 400, "Bad Request",
             "You sent a request that the server couldn't understand.");
     }
@@ -1951,16 +4024,282 @@ static void process_request(struct connection *conn)
     }
     else
     {
+        conn->conn_close = 1;
         default_reply(conn, 400, "Bad Request",
             "%s is not a valid HTTP/1.1 method.", conn->method);
     }
 
-    /* advance state */
-    conn->state = SEND_HEADER;
+    /* advance state, unless process_get() parked us on the fs pool (which
+     * still needs the request)
+     */
+    if (conn->state == RECV_REQUEST)
+        conn->state = SEND_HEADER;
+}
+
 
-    /* request not needed anymore */
-    free(conn->request);
-    conn->request = NULL; /* important: don't free it again later */
+
+/* ---------------------------------------------------------------------------
+ * Returns the index of the first LF in buf[i, len), or len if there isn't one.
+ */
+static size_t next_lf(const char *buf, size_t i, const size_t len)
+{
+#ifdef __SSE2__
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    for (; i + 16 <= len; i += 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(buf + i)), lf));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < len && buf[i] != '\n'; i++)
+        ;
+    return i;
+}
+
+/* ---------------------------------------------------------------------------
+ * Find the blank line that ends the request headers: an LF followed by LF or
+ * CRLF, wherever it is in what we've received.  Scanning resumes where the
+ * last call left off, so each recv only costs its new bytes.  Returns the
+ * length of the headers including the blank line, or 0 if they aren't all
+ * here yet.
+ */
+static size_t headers_end(const char *buf, size_t *scanned, const size_t len)
+{
+    size_t i = *scanned;
+
+    while ((i = next_lf(buf, i, len)) < len)
+    {
+        /* it takes up to two more bytes to tell */
+        if (i + 1 == len ||
+            (buf[i+1] == '\r' && i + 2 == len)) break;
+        if (buf[i+1] == '\n') return i + 2;
+        if (buf[i+1] == '\r' && buf[i+2] == '\n') return i + 3;
+        i++;
+    }
+    *scanned = i;
+    return 0;
+}
+
+static size_t find_request_end(struct connection *conn)
+{
+    size_t end = headers_end(conn->request, &conn->request_scanned,
+        conn->request_length);
+
+    if (end != 0)
+    {
+        /* is there a whole pipelined request behind this one? */
+        size_t next = end;
+        conn->pipelined =
+            (headers_end(conn->request, &next, conn->request_length) != 0);
+    }
+    return end;
+}
+
+/* ---------------------------------------------------------------------------
+ * TLS.  OpenSSL does the handshake and then, where it can, hands the session
+ * keys to the kernel (kTLS), after which send(), sendmsg() and sendfile() on
+ * the socket are encrypted on their way out: replies go out exactly as they
+ * do over plain HTTP, sendfile() and all.  Without kTLS (no tls module, or a
+ * cipher the kernel doesn't do) replies go through SSL_write() instead.
+ * Requests are always read with SSL_read().
+ *
+ * Session tickets are on, with keys made up by tls_init() before workers are
+ * forked, so a returning client can resume with any of them.
+ */
+#ifdef HAVE_OPENSSL
+static void tls_init(void)
+{
+    const char *key = (tls_key != NULL) ? tls_key : tls_cert;
+
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (tls_ctx == NULL) errx(1, "SSL_CTX_new() failed");
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_NO_RENEGOTIATION
+#ifdef SSL_OP_ENABLE_KTLS
+        | SSL_OP_ENABLE_KTLS
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+        | SSL_OP_IGNORE_UNEXPECTED_EOF
+#endif
+        );
+    /* we retry from wherever the reply has got to, which isn't always the
+     * same buffer, and don't hold on to buffers while idle
+     */
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_session_id_context(tls_ctx,
+        (const unsigned char *)pkgname, (unsigned int)strlen(pkgname));
+
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, tls_cert) != 1)
+        errx(1, "can't load certificate chain from %s", tls_cert);
+    if (SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1)
+        errx(1, "can't load private key from %s", key);
+    if (SSL_CTX_check_private_key(tls_ctx) != 1)
+        errx(1, "private key in %s doesn't match the certificate", key);
+}
+
+/* Map what SSL_read() or SSL_write() returned onto what recv() or send()
+ * would have: -1 and EAGAIN if it would block, 0 on closure.
+ */
+static ssize_t tls_result(struct connection *conn, const int ret)
+{
+    if (ret > 0) return ret;
+    switch (SSL_get_error(conn->ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+
+    default:
+        if (debug) ERR_print_errors_fp(stdout);
+        ERR_clear_error();
+        SSL_set_quiet_shutdown(conn->ssl, 1); /* no close_notify now */
+        errno = EIO;
+        return -1;
+    }
+}
+
+/* Set up TLS on a newly accepted connection and start the handshake. */
+static void tls_accept(struct connection *conn)
+{
+    conn->ssl = SSL_new(tls_ctx);
+    if (conn->ssl == NULL || SSL_set_fd(conn->ssl, conn->socket) != 1)
+    {
+        ERR_clear_error();
+        conn->conn_close = 1;
+        conn->state = DONE;
+        return;
+    }
+    SSL_set_accept_state(conn->ssl);
+    conn->state = TLS_HANDSHAKE;
+    tls_handshake(conn);
+}
+
+/* Carry on with the handshake, and once it's done go on to the request. */
+static void tls_handshake(struct connection *conn)
+{
+    const int ret = SSL_do_handshake(conn->ssl);
+
+    assert(conn->state == TLS_HANDSHAKE);
+    if (ret == 1)
+    {
+        conn->ktls = (BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) > 0);
+        stats->tls_handshakes++;
+        if (SSL_session_reused(conn->ssl)) stats->tls_resumed++;
+        if (conn->ktls) stats->tls_ktls++;
+        if (debug) printf("TLS handshake on %d done: %s, %s%s%s\n",
+            conn->socket, SSL_get_version(conn->ssl),
+            SSL_get_cipher_name(conn->ssl),
+            SSL_session_reused(conn->ssl) ? ", resumed" : "",
+            conn->ktls ? ", kTLS" : "");
+        conn->state = RECV_REQUEST;
+        poll_recv_request(conn);
+        return;
+    }
+
+    switch (SSL_get_error(conn->ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        conn->tls_want = EV_READ;
+        break;
+
+    case SSL_ERROR_WANT_WRITE:
+        conn->tls_want = EV_WRITE;
+        break;
+
+    default:
+        if (debug) ERR_print_errors_fp(stdout);
+        ERR_clear_error();
+        SSL_set_quiet_shutdown(conn->ssl, 1);
+        conn->conn_close = 1;
+        conn->state = DONE;
+    }
+}
+
+/* Send close_notify if we can do it without waiting, and free the session. */
+static void tls_close(struct connection *conn)
+{
+    if (SSL_is_init_finished(conn->ssl)) (void)SSL_shutdown(conn->ssl);
+    ERR_clear_error();
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+}
+#endif
+
+/* Is this connection's TLS done by OpenSSL, rather than the kernel or not at
+ * all?  Then we can't write to the socket ourselves.
+ */
+static int tls_userspace(const struct connection *conn)
+{
+#ifdef HAVE_OPENSSL
+    return (conn->ssl != NULL && !conn->ktls);
+#else
+    (void)conn;
+    return 0;
+#endif
+}
+
+/* recv() from a connection. */
+static ssize_t conn_recv(struct connection *conn, char *buf, const size_t len)
+{
+#ifdef HAVE_OPENSSL
+    if (conn->ssl != NULL)
+    {
+        ssize_t got = tls_result(conn, SSL_read(conn->ssl, buf, (int)len));
+        int ret;
+
+        /* take anything else that's been decrypted already, the socket
+         * won't wake us up for it
+         */
+        while (got > 0 && (size_t)got < len && SSL_pending(conn->ssl) > 0 &&
+            (ret = SSL_read(conn->ssl, buf + got, (int)(len - got))) > 0)
+                got += ret;
+        return got;
+    }
+#endif
+    return recv(conn->socket, buf, len, 0);
+}
+
+/* send() to a connection. */
+static ssize_t conn_send(struct connection *conn, const char *buf,
+    const size_t len, const int flags)
+{
+#ifdef HAVE_OPENSSL
+    if (tls_userspace(conn))
+        return tls_result(conn, SSL_write(conn->ssl, buf,
+            (int)min(len, (size_t)SENDFILE_MAX)));
+#endif
+    return send(conn->socket, buf, len, flags);
+}
+
+/* send_from_file() to a connection, from its reply_fd.  Without kTLS it's
+ * read in a record at a time and goes through SSL_write().
+ */
+static ssize_t conn_send_file(struct connection *conn, const off_t ofs,
+    const off_t length)
+{
+#ifdef HAVE_OPENSSL
+    if (tls_userspace(conn))
+    {
+        char buf[SSL3_RT_MAX_PLAIN_LENGTH];
+        const size_t amount = (size_t)min(length, (off_t)sizeof(buf));
+        const ssize_t numread = pread(conn->reply_fd, buf, amount, ofs);
+
+        if (numread != (ssize_t)amount)
+        {
+            if (numread != -1) errno = EIO; /* it got shorter */
+            return -1;
+        }
+        return tls_result(conn, SSL_write(conn->ssl, buf, (int)amount));
+    }
+#endif
+    return send_from_file(conn->socket, conn->reply_fd, ofs, length);
 }
 
 
@@ -1970,16 +4309,37 @@ static void process_request(struct connection *conn)
  */
 static void poll_recv_request(struct connection *conn)
 {
-    #define BUFSIZE 65536
-    char buf[BUFSIZE];
     ssize_t recvd;
 
     assert(conn->state == RECV_REQUEST);
-    recvd = recv(conn->socket, buf, BUFSIZE, 0);
+
+    /* a pipelined request might be here in full already */
+    if (conn->request_length > 0 &&
+        (conn->request_end = find_request_end(conn)) != 0)
+    {
+        process_request(conn);
+        if (conn->state == SEND_HEADER)
+            poll_send_header(conn);
+        return;
+    }
+
+    if (conn->request == NULL) conn->request = reqbuf_get();
+
+    /* receive straight into the request buffer, there's always room since
+     * anything longer than MAX_REQUEST_LENGTH stops us receiving
+     */
+    recvd = conn_recv(conn, conn->request + conn->request_length,
+        REQUEST_BUFSIZE - 1 - conn->request_length);
     if (debug) printf("poll_recv_request(%d) got %d bytes\n",
         conn->socket, (int)recvd);
     if (recvd <= 0)
     {
+        /* don't hold on to a buffer while idle */
+        if (conn->request_length == 0)
+        {
+            reqbuf_put(conn->request);
+            conn->request = NULL;
+        }
         if (recvd == -1) {
             if (errno == EAGAIN) {
                 if (debug) printf("poll_recv_request would have blocked\n");
@@ -1992,26 +4352,19 @@ static void poll_recv_request(struct connection *conn)
         conn->state = DONE;
         return;
     }
-    conn->last_active = now;
-    #undef BUFSIZE
+    touch_connection(conn);
 
-    /* append to conn->request */
-    conn->request = xrealloc(conn->request, conn->request_length+recvd+1);
-    memcpy(conn->request+conn->request_length, buf, (size_t)recvd);
     conn->request_length += recvd;
     conn->request[conn->request_length] = 0;
-    total_in += recvd;
+    stats->total_in += recvd;
 
     /* process request if we have all of it */
-    if ((conn->request_length > 2) &&
-        (memcmp(conn->request+conn->request_length-2, "\n\n", 2) == 0))
-            process_request(conn);
-    else if ((conn->request_length > 4) &&
-        (memcmp(conn->request+conn->request_length-4, "\r\n\r\n", 4) == 0))
-            process_request(conn);
+    if ((conn->request_end = find_request_end(conn)) != 0)
+        process_request(conn);
 
     /* die if it's too long */
-    if (conn->request_length > MAX_REQUEST_LENGTH)
+    if (conn->state == RECV_REQUEST &&
+        conn->request_length > MAX_REQUEST_LENGTH)
     {
         default_reply(conn, 413, "Request Entity Too Large",
             "Your request was dropped because it was too long.");
@@ -2028,20 +4381,59 @@ static void poll_recv_request(struct connection *conn)
 
 
 /* ---------------------------------------------------------------------------
- * Sending header.  Assumes conn->header is not NULL.
+ * Sending header.  Assumes conn->header is not NULL.  As much of the body as
+ * we have in memory goes out in the same sendmsg(), so a small reply leaves
+ * in one segment.  A bigger file body follows from sendfile(), and MSG_MORE
+ * holds the header back until it does.
  */
 static void poll_send_header(struct connection *conn)
 {
+    char buf[COALESCE_MAX];
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t header_left;
     ssize_t sent;
+    int flags = conn->pipelined ? MSG_MORE : 0;
 
     assert(conn->state == SEND_HEADER);
     assert(conn->header_length == strlen(conn->header));
 
-    sent = send(conn->socket, conn->header + conn->header_sent,
-        conn->header_length - conn->header_sent, 0);
-    conn->last_active = now;
-    if (debug) printf("poll_send_header(%d) sent %d bytes\n",
-        conn->socket, (int)sent);
+    header_left = conn->header_length - conn->header_sent;
+    iov[0].iov_base = conn->header + conn->header_sent;
+    iov[0].iov_len = header_left;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+
+    if (!conn->header_only && conn->reply_length > 0 && !tls_userspace(conn))
+    {
+        if (conn->reply_type == REPLY_GENERATED)
+        {
+            iov[1].iov_base = conn->reply + conn->reply_start;
+            iov[1].iov_len = (size_t)min(conn->reply_length,
+                (off_t)send_quantum);
+            msg.msg_iovlen = 2;
+        }
+        else if (conn->reply_type == REPLY_FROMFILE &&
+            conn->reply_length <= COALESCE_MAX &&
+            pread(conn->reply_fd, buf, (size_t)conn->reply_length,
+                conn->reply_start) == (ssize_t)conn->reply_length)
+        {
+            iov[1].iov_base = buf;
+            iov[1].iov_len = (size_t)conn->reply_length;
+            msg.msg_iovlen = 2;
+        }
+        else
+            flags |= MSG_MORE; /* poll_send_reply() brings the rest */
+    }
+
+    if (tls_userspace(conn))
+        sent = conn_send(conn, iov[0].iov_base, iov[0].iov_len, flags);
+    else
+        sent = sendmsg(conn->socket, &msg, flags);
+    touch_connection(conn);
+    if (debug) printf("poll_send_header(%d) sent %ld bytes\n",
+        conn->socket, (long)sent);
 
     /* handle any errors (-1) or closure (0) in send() */
     if (sent < 1)
@@ -2056,21 +4448,28 @@ static void poll_send_header(struct connection *conn)
         conn->state = DONE;
         return;
     }
-    conn->header_sent += sent;
     conn->total_sent += sent;
-    total_out += sent;
+    stats->total_out += sent;
+    if ((size_t)sent <= header_left)
+        conn->header_sent += sent;
+    else
+    {
+        conn->header_sent = conn->header_length;
+        conn->reply_sent = (off_t)(sent - header_left);
+    }
 
     /* check if we're done sending header */
     if (conn->header_sent == conn->header_length)
     {
-        if (conn->header_only)
+        if (conn->header_only || conn->reply_sent == conn->reply_length)
             conn->state = DONE;
         else {
             conn->state = SEND_REPLY;
-            /* go straight on to body, don't go through another iteration of
-             * the select() loop.
+            /* go straight on to a body we haven't tried to send yet, don't
+             * go through another iteration of the select() loop.
              */
-            poll_send_reply(conn);
+            if (msg.msg_iovlen == 1)
+                poll_send_reply(conn);
         }
     }
 }
@@ -2078,14 +4477,16 @@ static void poll_send_header(struct connection *conn)
 
 
 /* ---------------------------------------------------------------------------
- * Send chunk on socket <s> from FILE *fp, starting at <ofs> and of size
- * <size>.  Use sendfile() if possible since it's zero-copy on some platforms.
- * Returns the number of bytes sent, 0 on closure, -1 if send() failed, -2 if
- * read error.
+ * Send chunk on socket <s> from file <fd>, starting at <ofs> and of at most
+ * <length> bytes, though no more than SENDFILE_MAX in one go.  Use sendfile()
+ * if possible since it's zero-copy on some platforms.  Returns the number of
+ * bytes sent, 0 on closure, -1 if send() failed, -2 if read error.
  */
 static ssize_t send_from_file(const int s, const int fd,
-    off_t ofs, const size_t size)
+    off_t ofs, const off_t length)
 {
+    const size_t size = (size_t)min(length, SENDFILE_MAX);
+
 #ifdef __FreeBSD__
     off_t sent;
     int ret = sendfile(fd, s, ofs, size, NULL, &sent, 0);
@@ -2113,8 +4514,8 @@ static ssize_t send_from_file(const int s, const int fd,
     ssize_t numread;
     #undef BUFSIZE
 
-    if (lseek(fd, ofs, SEEK_SET) == -1) err(1, "fseek(%d)", (int)ofs);
-    numread = read(fd, buf, amount);
+    /* pread(), the fd is shared with other connections */
+    numread = pread(fd, buf, amount, ofs);
     if (numread == 0)
     {
         fprintf(stderr, "premature eof on fd %d\n", fd);
@@ -2127,8 +4528,8 @@ static ssize_t send_from_file(const int s, const int fd,
     }
     else if ((size_t)numread != amount)
     {
-        fprintf(stderr, "read %d bytes, expecting %u bytes on fd %d\n",
-            numread, amount, fd);
+        fprintf(stderr, "read %ld bytes, expecting %lu bytes on fd %d\n",
+            (long)numread, (unsigned long)amount, fd);
         return -1;
     }
     else
@@ -2140,32 +4541,90 @@ static ssize_t send_from_file(const int s, const int fd,
 
 
 /* ---------------------------------------------------------------------------
- * Sending reply.
+ * Send up to [quota] bytes of a multipart/byteranges reply, or as much as the
+ * socket will take: part headers from memory, and the slices from the cached
+ * contents or the file.  Returns like send().
+ */
+static ssize_t send_parts(struct connection *conn, const off_t quota)
+{
+    const struct reply_part *part;
+    ssize_t sent, total = 0;
+    off_t want, done;
+    int flags;
+
+    while (conn->part < conn->num_parts && total < quota)
+    {
+        part = conn->parts + conn->part;
+        done = conn->part_sent;
+        if (done < (off_t)part->header_length)
+        {
+            /* the closing delimiter is the last thing we send */
+            flags = (conn->part + 1 < conn->num_parts || conn->pipelined) ?
+                MSG_MORE : 0;
+            want = min((off_t)part->header_length - done, quota - total);
+            sent = conn_send(conn, part->header + done, (size_t)want, flags);
+        }
+        else
+        {
+            done -= part->header_length;
+            want = min(part->length - done, quota - total);
+            if (conn->reply != NULL)
+                sent = conn_send(conn, conn->reply + part->offset + done,
+                    (size_t)want, MSG_MORE);
+            else
+                sent = conn_send_file(conn, part->offset + done, want);
+        }
+        if (sent < 1)
+            return (total > 0) ? total : sent;
+
+        total += sent;
+        conn->part_sent += sent;
+        if (conn->part_sent == (off_t)part->header_length + part->length)
+        {
+            conn->part++;
+            conn->part_sent = 0;
+        }
+        else if (sent < want)
+            break; /* the socket's full */
+    }
+    return total;
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Sending reply, at most send_quantum bytes of it per call so that every
+ * connection gets its turn.
  */
 static void poll_send_reply(struct connection *conn)
 {
+    const off_t quota = min(conn->reply_length - conn->reply_sent,
+        (off_t)send_quantum);
     ssize_t sent;
 
     assert(conn->state == SEND_REPLY);
     assert(!conn->header_only);
     if (conn->reply_type == REPLY_GENERATED)
     {
-        sent = send(conn->socket,
+        sent = conn_send(conn,
             conn->reply + conn->reply_start + conn->reply_sent,
-            conn->reply_length - conn->reply_sent, 0);
+            (size_t)quota,
+            conn->pipelined ? MSG_MORE : 0);
     }
+    else if (conn->reply_type == REPLY_MULTIPART)
+        sent = send_parts(conn, quota);
     else
     {
-        sent = send_from_file(conn->socket, conn->reply_fd,
-            (off_t)(conn->reply_start + conn->reply_sent),
-            conn->reply_length - conn->reply_sent);
+        sent = conn_send_file(conn, conn->reply_start + conn->reply_sent,
+            quota);
     }
-    conn->last_active = now;
-    if (debug) printf("poll_send_reply(%d) sent %d: %d+[%d-%d] of %d\n",
-        conn->socket, (int)sent, (int)conn->reply_start,
-        (int)conn->reply_sent,
-        (int)(conn->reply_sent + sent - 1),
-        (int)conn->reply_length);
+    touch_connection(conn);
+    if (debug) printf(
+        "poll_send_reply(%d) sent %ld: %llu+[%llu-%llu] of %llu\n",
+        conn->socket, (long)sent, (unsigned long long)conn->reply_start,
+        (unsigned long long)conn->reply_sent,
+        (unsigned long long)(conn->reply_sent + sent - 1),
+        (unsigned long long)conn->reply_length);
 
     /* handle any errors (-1) or closure (0) in send() */
     if (sent < 1)
@@ -2187,9 +4646,9 @@ static void poll_send_reply(struct connection *conn)
         conn->state = DONE;
         return;
     }
-    conn->reply_sent += (unsigned int)sent;
-    conn->total_sent += (unsigned int)sent;
-    total_out += sent;
+    conn->reply_sent += sent;
+    conn->total_sent += sent;
+    stats->total_out += sent;
 
     /* check if we're done sending */
     if (conn->reply_sent == conn->reply_length) conn->state = DONE;
@@ -2203,6 +4662,7 @@ static void poll_send_reply(struct connection *conn)
 static void log_connection(const struct connection *conn)
 {
     struct in_addr inaddr;
+    char ipaddr[INET_ADDRSTRLEN];
 
     if (logfile == NULL)
         return;
@@ -2217,10 +4677,11 @@ static void log_connection(const struct connection *conn)
 
     inaddr.s_addr = conn->client;
 
-    fprintf(logfile, "%lu\t%s\t%s\t%s\t%d\t%u\t\"%s\"\t\"%s\"\n",
-        (unsigned long int)now, inet_ntoa(inaddr),
+    fprintf(logfile, "%lu\t%s\t%s\t%s\t%d\t%llu\t\"%s\"\t\"%s\"\n",
+        (unsigned long int)now,
+        inet_ntop(AF_INET, &inaddr, ipaddr, sizeof(ipaddr)),
         conn->method, conn->uri,
-        conn->http_code, conn->total_sent,
+        conn->http_code, (unsigned long long)conn->total_sent,
         (conn->referer == NULL)?"":conn->referer,
         (conn->user_agent == NULL)?"":conn->user_agent
         );
@@ -2230,115 +4691,160 @@ static void log_connection(const struct connection *conn)
 
 
 /* ---------------------------------------------------------------------------
- * Main loop of the httpd - a select() and then delegation to accept
- * connections, handle receiving of requests, and sending of replies.
+ * Called after a connection has been polled.  Finished connections are
+ * recycled for keep-alive or removed from connlist and deallocated;
+ * everything else gets its event registration brought in line with its
+ * (possibly new) state.
  */
-static void httpd_poll(void)
+static void finish_poll(struct connection *conn)
 {
-    fd_set recv_set, send_set;
-    int max_fd, select_ret;
-    struct connection *conn, *next;
-    int bother_with_timeout = 0;
-    struct timeval timeout;
-
-    timeout.tv_sec = idletime;
-    timeout.tv_usec = 0;
+    while (conn->state == DONE && !conn->conn_close)
+    {
+        recycle_connection(conn);
+        /* and go right back to recv_request without waiting for another
+         * event.
+         */
+        poll_recv_request(conn);
+    }
 
-    FD_ZERO(&recv_set);
-    FD_ZERO(&send_set);
-    max_fd = 0;
+    if (conn->state != DONE)
+    {
+        int mask = (conn->state == RECV_REQUEST) ? EV_READ :
+                   (conn->state == WAIT_FS) ? 0 : EV_WRITE;
 
-    /* set recv/send fd_sets */
-    #define MAX_FD_SET(sock, fdset) { FD_SET(sock,fdset); \
-                                    max_fd = (max_fd<sock) ? sock : max_fd; }
+#ifdef HAVE_OPENSSL
+        if (conn->state == TLS_HANDSHAKE) mask = conn->tls_want;
+#endif
 
-    MAX_FD_SET(sockin, &recv_set);
+        if (mask != conn->ev_mask)
+        {
+            if (ev->set(conn->socket, conn, conn->ev_mask, mask) == -1)
+            {
+                if (debug) printf("%s set(%d) failed: %s\n",
+                    ev->name, conn->socket, strerror(errno));
+                conn->conn_close = 1;
+                /* a parked conn belongs to the fs pool until fs_complete() */
+                if (conn->state != WAIT_FS) conn->state = DONE;
+            }
+            else
+                conn->ev_mask = mask;
+        }
+    }
 
-    LIST_FOREACH_SAFE(conn, &connlist, entries, next)
+    if (conn->state == DONE)
     {
-        poll_check_timeout(conn);
-        switch (conn->state)
-        {
-        case DONE:
-            /* do nothing */
-            break;
+        TAILQ_REMOVE(&connlist, conn, entries);
+        free_connection(conn);
+        conn_release(conn);
+    }
+}
 
-        case RECV_REQUEST:
-            MAX_FD_SET(conn->socket, &recv_set);
-            bother_with_timeout = 1;
-            break;
 
-        case SEND_HEADER:
-        case SEND_REPLY:
-            MAX_FD_SET(conn->socket, &send_set);
-            bother_with_timeout = 1;
-            break;
 
-        default: errx(1, "invalid state");
-        }
-    }
-    #undef MAX_FD_SET
+/* ---------------------------------------------------------------------------
+ * Main loop of the httpd - wait for events and then delegate to accept
+ * connections, handle receiving of requests, and sending of replies.
+ *
+ * Replies go out a send_quantum at a time, and the backends are all level-
+ * triggered, so a connection with more to send is simply reported again
+ * next time round: every ready sender gets one quantum per wakeup.  Senders
+ * with more than a quantum left go last, so short replies aren't queued
+ * behind big downloads.
+ */
+static void httpd_poll(void)
+{
+    struct ev_event events[EV_MAX_EVENTS];
+    struct connection *conn, *bulk[EV_MAX_EVENTS];
+    int i, num_events, num_bulk = 0, timeout_ms = -1;
 
-    /* -select- */
-    select_ret = select(max_fd + 1, &recv_set, &send_set, NULL,
-        (bother_with_timeout) ? &timeout : NULL);
-    if (select_ret == 0)
+    /* kill off idle connections: they're at the front of connlist, so stop
+     * at the first one that isn't, and sleep until it expires
+     */
+    while ((conn = TAILQ_FIRST(&connlist)) != NULL)
     {
-        if (!bother_with_timeout)
-            errx(1, "select() timed out");
-        else
-            return;
+        poll_check_timeout(conn);
+        if (conn->state != DONE) break;
+        finish_poll(conn);
+    }
+    if (conn != NULL && idletime > 0)
+        timeout_ms = (int)(conn->last_active + idletime - now) * 1000;
+    if (upgrade_fd != -1)
+    {
+        const int left = (int)max(upgrade_deadline - now, 0) * 1000;
+
+        if (timeout_ms == -1 || left < timeout_ms) timeout_ms = left;
     }
-    if (select_ret == -1) {
+
+    num_events = ev->wait(timeout_ms, events, EV_MAX_EVENTS);
+    if (num_events == -1) {
         if (errno == EINTR)
             return; /* interrupted by signal */
         else
-            err(1, "select() failed");
+            err(1, "%s wait failed", ev->name);
     }
 
     /* update time */
     now = time(NULL);
 
-    /* poll connections that select() says need attention */
-    if (FD_ISSET(sockin, &recv_set)) accept_connection();
-
-    LIST_FOREACH_SAFE(conn, &connlist, entries, next)
+    /* poll connections that the backend says need attention */
+    for (i = 0; i < num_events; i++)
     {
+        conn = events[i].data;
+        if (conn == NULL)
+        {
+            /* sockin is registered without a connection */
+            accept_connection();
+            continue;
+        }
+        if (events[i].data == &wake_tag)
+        {
+            wake_drain();
+            fs_complete();
+            continue;
+        }
+        if (events[i].data == &upgrade_tag)
+            continue; /* event_loop() reads it */
+
         switch (conn->state)
         {
+#ifdef HAVE_OPENSSL
+        case TLS_HANDSHAKE:
+            tls_handshake(conn);
+            break;
+#endif
+
         case RECV_REQUEST:
-            if (FD_ISSET(conn->socket, &recv_set)) poll_recv_request(conn);
+            if (events[i].events & EV_READ) poll_recv_request(conn);
             break;
 
         case SEND_HEADER:
-            if (FD_ISSET(conn->socket, &send_set)) poll_send_header(conn);
+            if (events[i].events & EV_WRITE) poll_send_header(conn);
             break;
 
         case SEND_REPLY:
-            if (FD_ISSET(conn->socket, &send_set)) poll_send_reply(conn);
+            if (!(events[i].events & EV_WRITE)) break;
+            if (conn->reply_length - conn->reply_sent > (off_t)send_quantum)
+            {
+                bulk[num_bulk++] = conn;
+                continue;
+            }
+            poll_send_reply(conn);
             break;
 
+        case WAIT_FS:
         case DONE:
-            /* (handled later; ignore for now as it's a valid state) */
+            /* (handled by fs_complete and finish_poll respectively) */
             break;
 
         default: errx(1, "invalid state");
         }
+        finish_poll(conn);
+    }
 
-        if (conn->state == DONE) {
-            /* clean out finished connection */
-            if (conn->conn_close) {
-                LIST_REMOVE(conn, entries);
-                free_connection(conn);
-                free(conn);
-            } else {
-                recycle_connection(conn);
-                /* and go right back to recv_request without going through
-                 * select() again.
-                 */
-                poll_recv_request(conn);
-            }
-        }
+    for (i = 0; i < num_bulk; i++)
+    {
+        poll_send_reply(bulk[i]);
+        finish_poll(bulk[i]);
     }
 }
 
@@ -2467,6 +4973,7 @@ pidfile_create(void)
             err(1, "can't create pidfile %s", pidfile_name);
     }
     pidfile_fd = fd;
+    cloexec_fd(fd);
 
     if (ftruncate(fd, 0) == -1) {
         error = errno;
@@ -2484,17 +4991,489 @@ pidfile_create(void)
     }
 }
 
+/* Point the pidfile at us without it ever being missing or half-written, for
+ * when we've taken over from an old shttpd that still has it.
+ */
+static void
+pidfile_replace(void)
+{
+    char *tmpname, pidstr[16];
+    int fd;
+
+    xasprintf(&tmpname, "%s.new", pidfile_name);
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, PIDFILE_MODE);
+    if (fd == -1)
+        err(1, "can't create pidfile %s", tmpname);
+    snprintf(pidstr, sizeof(pidstr), "%u", getpid());
+    if (write(fd, pidstr, strlen(pidstr)) != (ssize_t)strlen(pidstr))
+        err(1, "write() to pidfile failed");
+    if (rename(tmpname, pidfile_name) == -1)
+        err(1, "rename(%s, %s)", tmpname, pidfile_name);
+    free(tmpname);
+    pidfile_fd = fd;
+    cloexec_fd(fd);
+}
+
 /* end of pidfile helpers.
  * ---------------------------------------------------------------------------
  * Close all sockets and FILEs and exit.
  */
+static int *loop_wake_fds = NULL; /* write end of each loop's wake channel */
+
 static void
 stop_running(int sig)
 {
+    int t;
+
     running = 0;
+    if (loop_wake_fds != NULL)
+        for (t=0; t<num_threads; t++)
+            if (loop_wake_fds[t] != -1) wake_loop(loop_wake_fds[t]);
     fprintf(stderr, "\ncaught %s, stopping\n", strsignal(sig));
 }
 
+/* ---------------------------------------------------------------------------
+ * Zero-downtime upgrades.  On SIGHUP or SIGUSR2 we start whatever binary is
+ * now at argv[0], with the same arguments, handing it our listeners through
+ * the environment.  Once it says it's ready we stop accepting, finish the
+ * connections we've got, and exit; connections queued on the listeners in
+ * the meantime are left for the new process.  Workers drain on SIGHUP.
+ */
+static void
+upgrade_signal(int sig)
+{
+    int t;
+
+    (void)sig;
+    if (is_worker)
+    {
+        draining = 1;
+        if (loop_wake_fds != NULL)
+            for (t=0; t<num_threads; t++)
+                if (loop_wake_fds[t] != -1) wake_loop(loop_wake_fds[t]);
+    }
+    else
+    {
+        upgrade_pending = 1; /* the supervisor or first loop does it */
+        if (loop_wake_fds != NULL && loop_wake_fds[0] != -1)
+            wake_loop(loop_wake_fds[0]);
+    }
+}
+
+/* Start the new process, and leave upgrade_fd to hear from it.  Returns 0 if
+ * it couldn't be started.
+ */
+static int
+upgrade_start(void)
+{
+    extern char **environ;
+    struct apbuf *fds;
+    char **envp, *ready_var;
+    size_t n, j;
+    int ready[2], i;
+    pid_t pid;
+
+    if (want_chroot)
+    {
+        warnx("can't upgrade from inside a chroot, restart instead");
+        return 0;
+    }
+    if (pipe(ready) == -1)
+    {
+        warn("pipe(upgrade)");
+        return 0;
+    }
+    cloexec_fd(ready[0]);
+
+    /* build the environment now, the child mustn't malloc */
+    fds = make_apbuf();
+    appendf(fds, "%s=", LISTEN_FDS_ENV);
+    for (i=0; i<num_listeners; i++)
+        appendf(fds, "%s%d", (i == 0) ? "" : ",", listeners[i]);
+    appendl(fds, "", 1);
+    xasprintf(&ready_var, "%s=%d", READY_FD_ENV, ready[1]);
+    for (n=0; environ[n] != NULL; n++)
+        ;
+    envp = xmalloc(sizeof(char *) * (n + 3));
+    for (n=0, j=0; environ[n] != NULL; n++)
+        if (strncmp(environ[n], "SHTTPD_", 7) != 0)
+            envp[j++] = environ[n];
+    envp[j++] = fds->str;
+    envp[j++] = ready_var;
+    envp[j] = NULL;
+
+    fflush(stdout); /* or the new process inherits the unflushed buffer */
+    pid = fork();
+    if (pid == 0)
+    {
+        environ = envp;
+        execvp(saved_argv[0], saved_argv);
+        _exit(127);
+    }
+    xclose(ready[1]);
+    free(envp);
+    free(ready_var);
+    free(fds->str);
+    free(fds);
+    if (pid == -1)
+    {
+        warn("fork(upgrade)");
+        xclose(ready[0]);
+        return 0;
+    }
+
+    /* it takes over once it's ready, which we mustn't block on */
+    nonblock_socket(ready[0]);
+    upgrade_fd = ready[0];
+    upgrade_pid = pid;
+    upgrade_reaped = 0;
+    upgrade_deadline = time(NULL) + UPGRADE_TIMEOUT;
+    return 1;
+}
+
+/* Check on the process upgrade_start() started, without blocking.  Returns 1
+ * once it's up, 0 while it's still starting, and -1 if it failed or didn't
+ * get ready in time, in which case it's killed.  [registered] if upgrade_fd
+ * is in the event backend.
+ */
+static int
+upgrade_poll(const int registered)
+{
+    ssize_t got;
+    int late = 0;
+    char c;
+
+    got = read(upgrade_fd, &c, 1);
+    if (got == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        if (time(NULL) < upgrade_deadline) return 0;
+        kill(upgrade_pid, SIGKILL);
+        late = 1;
+    }
+    if (registered) (void)ev->set(upgrade_fd, &upgrade_tag, EV_READ, 0);
+    xclose(upgrade_fd);
+    upgrade_fd = -1;
+    if (got == 1)
+    {
+        printf("handed off to pid %d, finishing up\n", (int)upgrade_pid);
+        handed_off = 1;
+        return 1;
+    }
+
+    if (!upgrade_reaped &&
+        waitpid(upgrade_pid, &upgrade_status, 0) == upgrade_pid)
+            upgrade_reaped = 1;
+    if (late)
+        warnx("upgrade failed: new process (pid %d) wasn't ready after "
+            "%d seconds", (int)upgrade_pid, UPGRADE_TIMEOUT);
+    else if (upgrade_reaped && WIFEXITED(upgrade_status) &&
+        WEXITSTATUS(upgrade_status) == 127)
+        warnx("upgrade failed: can't execute %s", saved_argv[0]);
+    else
+        warnx("upgrade failed: new process (pid %d) didn't start",
+            (int)upgrade_pid);
+    return -1;
+}
+
+/* Tell the old shttpd that we're up, see upgrade_start(). */
+static void
+upgrade_ready(void)
+{
+    const char *ready = getenv(READY_FD_ENV);
+    int fd;
+
+    if (ready == NULL) return;
+    fd = atoi(ready);
+    unsetenv(READY_FD_ENV);
+    fflush(stdout);
+    if (write(fd, "", 1) != 1)
+        warn("write(upgrade ready)");
+    xclose(fd);
+}
+
+/* ---------------------------------------------------------------------------
+ * Close and free all connections.
+ */
+static void
+free_connlist(void)
+{
+    struct connection *conn, *next;
+
+    TAILQ_FOREACH_SAFE(conn, &connlist, entries, next)
+    {
+        TAILQ_REMOVE(&connlist, conn, entries);
+        free_connection(conn);
+        conn_release(conn);
+    }
+}
+
+/* Stop accepting and close idle keep-alive connections.  The others are
+ * closed once their current reply has been sent.
+ */
+static void
+drain_connections(void)
+{
+    struct connection *conn, *next;
+
+    (void)ev->set(sockin, NULL, EV_READ, 0);
+    TAILQ_FOREACH_SAFE(conn, &connlist, entries, next)
+    {
+        conn->conn_close = 1;
+        if (conn->state == RECV_REQUEST && conn->request_length == 0)
+        {
+            conn->state = DONE;
+            finish_poll(conn);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Event loop threads.  Each thread runs httpd_poll() over its own connlist,
+ * accepting from its own listener and counting into its own stats slot, so
+ * the only state the loops share is read-mostly, like the mime_map.
+ */
+static void *
+event_loop(void *arg)
+{
+    const int t = (int)(size_t)arg;
+    int drain_started = 0;
+
+    sockin = listeners[listener_base + t];
+    stats = &stats_slots[listener_base + t];
+    TAILQ_INIT(&connlist);
+    if (t != 0 && ev->init() == -1)
+        err(1, "%s init", ev->name);
+    if (ev->set(sockin, NULL, 0, EV_READ) == -1)
+        err(1, "%s set(sockin)", ev->name);
+    wake_init();
+    loop_wake_fds[t] = wake_fds[1];
+    reserve_fd = reserve_socket();
+    if (conn_prealloc > 0) conn_slab_grow(conn_prealloc);
+    pthread_mutex_init(&fs_done.lock, NULL);
+    fs_done.wake_fd = wake_fds[1];
+
+    /* main loop */
+    now = time(NULL);
+    while (running)
+    {
+        httpd_poll();
+        if (t == 0 && upgrade_pending)
+        {
+            upgrade_pending = 0;
+            if (upgrade_fd == -1 && upgrade_start() &&
+                ev->set(upgrade_fd, &upgrade_tag, 0, EV_READ) == -1)
+                    err(1, "%s set(upgrade)", ev->name);
+        }
+        if (upgrade_fd != -1 && upgrade_poll(1) == 1)
+        {
+            int i;
+
+            draining = 1;
+            for (i=1; i<num_threads; i++)
+                if (loop_wake_fds[i] != -1) wake_loop(loop_wake_fds[i]);
+        }
+        if (draining)
+        {
+            if (!drain_started)
+            {
+                drain_connections();
+                drain_started = 1;
+            }
+            if (TAILQ_EMPTY(&connlist) && fs_pending == 0) break;
+        }
+    }
+
+    loop_wake_fds[t] = -1;
+
+    /* connections waiting on the fs pool aren't in connlist yet */
+    while (fs_pending > 0)
+    {
+        usleep(1000);
+        fs_complete();
+    }
+    free_connlist();
+    conn_slab_free();
+    reqbuf_pool_free();
+    wake_close();
+    pthread_mutex_destroy(&fs_done.lock);
+    if (reserve_fd != -1) xclose(reserve_fd);
+    return NULL;
+}
+
+/* Run num_threads event loops, the first one on the calling thread, until
+ * we're told to stop.
+ */
+static void
+run_event_loops(void)
+{
+    pthread_t *threads;
+    sigset_t all, old;
+    int t, error;
+
+    threads = xmalloc(sizeof(pthread_t) * num_threads);
+    loop_wake_fds = xmalloc(sizeof(int) * num_threads);
+    for (t=0; t<num_threads; t++)
+        loop_wake_fds[t] = -1;
+    ev_init();
+
+    /* leave signals to the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    fs_pool_start();
+    for (t=1; t<num_threads; t++)
+    {
+        error = pthread_create(&threads[t], NULL, event_loop,
+            (void *)(size_t)t);
+        if (error != 0)
+        {
+            errno = error;
+            err(1, "pthread_create()");
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    event_loop((void *)0);
+    for (t=1; t<num_threads; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+    fs_pool_stop();
+}
+
+/* ---------------------------------------------------------------------------
+ * Worker processes.  Each worker accepts from its own listeners (one per
+ * thread) and counts into their stats slots; the parent just supervises them,
+ * restarting any worker that dies on the same listeners.
+ */
+static pid_t *worker_pids = NULL;
+static time_t *worker_started = NULL;
+
+/* Returns 1 in the new worker, 0 in the supervisor. */
+static int
+start_worker(const int i)
+{
+    pid_t pid;
+
+    fflush(stdout); /* or the worker inherits the unflushed buffer */
+    pid = fork();
+    if (pid == -1)
+    {
+        warn("fork(worker %d)", i);
+        return 0;
+    }
+    if (pid == 0)
+    {
+        int j;
+
+        is_worker = 1;
+        listener_base = i * num_threads;
+        for (j=0; j<num_listeners; j++)
+            if (j < listener_base || j >= listener_base + num_threads)
+                xclose(listeners[j]);
+#ifdef __linux
+        /* don't outlive the supervisor */
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1)
+            warn("prctl(PR_SET_PDEATHSIG)");
+#endif
+        return 1;
+    }
+    worker_pids[i] = pid;
+    worker_started[i] = time(NULL);
+    return 0;
+}
+
+/* A worker that died took its connections with it, so they're no longer
+ * open.
+ */
+static void
+forget_connections(const int i)
+{
+    int j;
+
+    for (j=i*num_threads; j<(i+1)*num_threads; j++)
+    {
+        __atomic_sub_fetch(&conn_count->open, stats_slots[j].conns_open,
+            __ATOMIC_RELAXED);
+        stats_slots[j].conns_open = 0;
+    }
+}
+
+/* Returns 1 in a worker, which should go on to serve requests, and 0 in the
+ * supervisor once it's time to shut down.
+ */
+static int
+supervise_workers(void)
+{
+    int i, status;
+    pid_t pid;
+
+    worker_pids = xmalloc(sizeof(pid_t) * num_workers);
+    worker_started = xmalloc(sizeof(time_t) * num_workers);
+    for (i=0; i<num_workers; i++)
+    {
+        worker_pids[i] = -1;
+        if (start_worker(i)) return 1;
+    }
+    printf("started %d workers\n", num_workers);
+
+    while (running)
+    {
+        if (upgrade_pending)
+        {
+            upgrade_pending = 0;
+            if (upgrade_fd == -1) (void)upgrade_start();
+        }
+        if (upgrade_fd != -1 && upgrade_poll(0) == 1) break;
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            if (upgrade_fd != -1 && pid == upgrade_pid)
+            {
+                /* upgrade_poll() will see the pipe close */
+                upgrade_status = status;
+                upgrade_reaped = 1;
+                continue;
+            }
+            for (i=0; i<num_workers && worker_pids[i] != pid; i++)
+                ;
+            if (i == num_workers) continue;
+            worker_pids[i] = -1;
+            if (!running) break;
+            forget_connections(i);
+
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "worker %d (pid %d) killed by %s\n",
+                    i, (int)pid, strsignal(WTERMSIG(status)));
+            else
+                fprintf(stderr, "worker %d (pid %d) exited with status %d\n",
+                    i, (int)pid, WEXITSTATUS(status));
+
+            /* don't spin on a worker that dies straight away */
+            if (time(NULL) - worker_started[i] < 1) sleep(1);
+            if (start_worker(i)) return 1;
+        }
+
+        /* interrupted by signals, so child deaths are picked up within a
+         * second and a stop request straight away
+         */
+        if (running && !upgrade_pending) sleep(1);
+    }
+
+    /* stop the workers, or once we've handed off let them finish their
+     * connections, and wait for them
+     */
+    for (i=0; i<num_workers; i++)
+        if (worker_pids[i] != -1)
+            kill(worker_pids[i], handed_off ? SIGHUP : SIGTERM);
+    for (i=0; i<num_workers; i++)
+        if (worker_pids[i] != -1)
+            while (waitpid(worker_pids[i], &status, 0) == -1 &&
+                errno == EINTR)
+                    if (!running) kill(worker_pids[i], SIGTERM);
+    free(worker_pids);
+    free(worker_started);
+    return 0;
+}
+
 /* ---------------------------------------------------------------------------
  * Execution starts here.
  */
@@ -2502,6 +5481,7 @@ int
 main(int argc, char **argv)
 {
     printf("%s, %s.\n", pkgname, copyright);
+    saved_argv = argv;
     parse_default_extension_map();
     parse_commandline(argc, argv);
     /* parse_commandline() might override parts of the extension map by
@@ -2509,17 +5489,37 @@ main(int argc, char **argv)
      */
     sort_mime_map();
     xasprintf(&keep_alive_field, "Keep-Alive: timeout=%d\r\n", idletime);
+    server_field_length = xasprintf(&server_field, "Server: %s\r\n", pkgname);
+    snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+        (unsigned long)time(NULL) & 0xffffffff, (unsigned long)getpid());
+    file_cache_init();
+#ifdef HAVE_OPENSSL
+    if (tls_cert != NULL) tls_init();
+#endif
+    if (num_workers > 0) num_listeners = num_workers * num_threads;
+    else num_listeners = num_threads;
     init_sockin();
 
+    /* shared with the workers, see struct httpd_stats */
+    stats_slots = mmap(NULL, sizeof(struct httpd_stats) * num_listeners,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (stats_slots == MAP_FAILED) err(1, "mmap(stats)");
+    stats = &stats_slots[0];
+    conn_count = mmap(NULL, sizeof(struct conn_count),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (conn_count == MAP_FAILED) err(1, "mmap(conn_count)");
+
     /* open logfile */
     if (logfile_name != NULL)
     {
         logfile = fopen(logfile_name, "ab");
         if (logfile == NULL)
             err(1, "opening logfile: fopen(\"%s\")", logfile_name);
+        cloexec_fd(fileno(logfile));
     }
 
-    if (want_daemon) daemonize_start();
+    /* (an upgraded daemon is detached already) */
+    if (want_daemon && !upgraded) daemonize_start();
 
     /* signals */
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
@@ -2530,6 +5530,10 @@ main(int argc, char **argv)
         err(1, "signal(SIGQUIT)");
     if (signal(SIGTERM, stop_running) == SIG_ERR)
         err(1, "signal(SIGTERM)");
+    if (signal(SIGHUP, upgrade_signal) == SIG_ERR)
+        err(1, "signal(SIGHUP)");
+    if (signal(SIGUSR2, upgrade_signal) == SIG_ERR)
+        err(1, "signal(SIGUSR2)");
 
     /* security */
     if (want_chroot)
@@ -2554,30 +5558,45 @@ main(int argc, char **argv)
     }
 
     /* create pidfile */
-    if (pidfile_name) pidfile_create();
+    if (pidfile_name)
+    {
+        if (upgraded) pidfile_replace();
+        else pidfile_create();
+    }
 
     if (want_daemon) daemonize_finish();
+    upgrade_ready();
 
-    /* main loop */
-    while (running) httpd_poll();
-
-    /* clean exit */
-    xclose(sockin);
-    if (logfile != NULL) fclose(logfile);
-    if (pidfile_name) pidfile_remove();
-
-    /* close and free connections */
+    if (num_workers == 0 || supervise_workers())
     {
-        struct connection *conn, *next;
+        run_event_loops();
 
-        LIST_FOREACH_SAFE(conn, &connlist, entries, next)
+        if (num_workers > 0)
         {
-            LIST_REMOVE(conn, entries);
-            free_connection(conn);
-            free(conn);
+            /* worker: the supervisor does the rest of the cleanup */
+            int i;
+            for (i=0; i<num_threads; i++)
+                xclose(listeners[listener_base + i]);
+            if (logfile != NULL) fclose(logfile);
+            exit(EXIT_SUCCESS);
         }
     }
 
+    /* clean exit */
+    {
+        int i;
+        for (i=0; i<num_listeners; i++)
+            xclose(listeners[i]);
+        free(listeners);
+    }
+    if (logfile != NULL) fclose(logfile);
+    if (pidfile_name)
+    {
+        if (handed_off) xclose(pidfile_fd); /* it's the new process' now */
+        else pidfile_remove();
+    }
+
+
     /* free the mallocs */
     {
         size_t i;
@@ -2588,22 +5607,71 @@ main(int argc, char **argv)
         }
         free(mime_map);
         free(keep_alive_field);
+        free(server_field);
+        file_cache_free();
+#ifdef HAVE_OPENSSL
+        if (tls_ctx != NULL) SSL_CTX_free(tls_ctx);
+#endif
         free(wwwroot);
     }
 
     /* usage stats */
     {
-        struct rusage r;
+        struct rusage r, rc;
+        struct httpd_stats total;
+        int i;
 
         getrusage(RUSAGE_SELF, &r);
+        if (num_workers > 0)
+        {
+            /* add in the workers */
+            getrusage(RUSAGE_CHILDREN, &rc);
+            timeradd(&r.ru_utime, &rc.ru_utime, &r.ru_utime);
+            timeradd(&r.ru_stime, &rc.ru_stime, &r.ru_stime);
+        }
         printf("CPU time used: %u.%02u user, %u.%02u system\n",
             (unsigned int)r.ru_utime.tv_sec,
                 (unsigned int)(r.ru_utime.tv_usec/10000),
             (unsigned int)r.ru_stime.tv_sec,
                 (unsigned int)(r.ru_stime.tv_usec/10000)
         );
-        printf("Requests: %u\n", num_requests);
-        printf("%lu KB in, %lu KB out\n", total_in/1024, total_out/1024);
+
+        memset(&total, 0, sizeof(total));
+        for (i=0; i<num_listeners; i++)
+        {
+            total.num_requests += stats_slots[i].num_requests;
+            total.total_in += stats_slots[i].total_in;
+            total.total_out += stats_slots[i].total_out;
+            total.num_accepts += stats_slots[i].num_accepts;
+            total.accept_wakeups += stats_slots[i].accept_wakeups;
+            total.accept_drops += stats_slots[i].accept_drops;
+            total.conns_high_water = max(total.conns_high_water,
+                stats_slots[i].conns_high_water);
+            total.conn_slab_size += stats_slots[i].conn_slab_size;
+            total.cache_hits += stats_slots[i].cache_hits;
+            total.cache_misses += stats_slots[i].cache_misses;
+            total.cache_evictions += stats_slots[i].cache_evictions;
+            total.tls_handshakes += stats_slots[i].tls_handshakes;
+            total.tls_resumed += stats_slots[i].tls_resumed;
+            total.tls_ktls += stats_slots[i].tls_ktls;
+        }
+        printf("Requests: %u\n", total.num_requests);
+        printf("%llu KB in, %llu KB out\n",
+            (unsigned long long)(total.total_in/1024),
+            (unsigned long long)(total.total_out/1024));
+        printf("Accepted %u connections in %u wakeups, "
+            "dropped %u for lack of descriptors\n",
+            total.num_accepts, total.accept_wakeups, total.accept_drops);
+        printf("At most %u connections at once (%u in one event loop), "
+            "in %u slab slots\n", conn_count->peak, total.conns_high_water,
+            total.conn_slab_size);
+        printf("File contents cache: %u hits, %u misses, %u evictions\n",
+            total.cache_hits, total.cache_misses, total.cache_evictions);
+#ifdef HAVE_OPENSSL
+        if (tls_cert != NULL)
+            printf("TLS: %u handshakes, %u resumed, %u with kTLS\n",
+                total.tls_handshakes, total.tls_resumed, total.tls_ktls);
+#endif
     }
 
     return (0);
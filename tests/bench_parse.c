@@ -0,0 +1,258 @@
+/* ---------------------------------------------------------------------------
+ * Request parsing benchmark: the one-pass parse_request() and its header
+ * index, against the strstr()-per-field parser it replaced, on a typical
+ * browser request.  Both get their own copy of the request every time, and
+ * look up the same five fields.
+ *
+ *   $ make bench
+ */
+#define main shttpd_main
+#include "../shttpd.c"
+#undef main
+
+/* A browser's request for a stylesheet, with a conditional and a range. */
+static const char browser_request[] =
+    "GET /static/css/site.css?v=20261018 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"129\", \"Not=A?Brand\";v=\"8\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/129.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Referer: https://www.example.com/articles/2026/10/some-article\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+    "Cookie: session=4f9d2c8e1b7a6d5c3e2f1a0b9c8d7e6f; theme=dark; "
+        "consent=1\r\n"
+    "If-Modified-Since: Sat, 17 Oct 2026 09:12:44 GMT\r\n"
+    "Range: bytes=0-1023\r\n"
+    "\r\n";
+
+#define ITERATIONS 1000000
+
+/* ---------------------------------------------------------------------------
+ * The old parser, from before the header index, with the connection fields
+ * it used gathered into a struct of its own.
+ */
+struct old_conn
+{
+    char *request;
+    size_t request_length;
+    char *method, *uri, *referer, *user_agent, *if_modified_since;
+    int conn_close;
+    size_t range_begin, range_end;
+    int range_begin_given, range_end_given;
+};
+
+static char *old_parse_field(const struct old_conn *conn, const char *field)
+{
+    size_t bound1, bound2;
+    char *pos;
+
+    /* find start */
+    pos = strstr(conn->request, field);
+    if (pos == NULL) return NULL;
+    bound1 = pos - conn->request + strlen(field);
+
+    /* find end */
+    for (bound2 = bound1;
+        conn->request[bound2] != '\r' &&
+        bound2 < conn->request_length; bound2++)
+            ;
+
+    /* copy to buffer */
+    return split_string(conn->request, bound1, bound2);
+}
+
+static void old_parse_range_field(struct old_conn *conn)
+{
+    size_t bound1, bound2, len;
+    char *range;
+
+    range = old_parse_field(conn, "Range: bytes=");
+    if (range == NULL) return;
+    len = strlen(range);
+
+    do /* break handling */
+    {
+        /* parse number up to hyphen */
+        bound1 = 0;
+        for (bound2=0;
+            isdigit( (int)range[bound2] ) && bound2 < len;
+            bound2++)
+                ;
+
+        if (bound2 == len || range[bound2] != '-')
+            break; /* there must be a hyphen here */
+
+        if (bound1 != bound2)
+        {
+            conn->range_begin_given = 1;
+            conn->range_begin = (size_t)strtol(range+bound1, NULL, 10);
+
+        }
+
+        /* parse number after hyphen */
+        bound2++;
+        for (bound1=bound2;
+            isdigit( (int)range[bound2] ) && bound2 < len;
+            bound2++)
+                ;
+
+        if (bound2 != len && range[bound2] != ',')
+            break; /* must be end of string or a list to be valid */
+
+        if (bound1 != bound2)
+        {
+            conn->range_end_given = 1;
+            conn->range_end = (size_t)strtol(range+bound1, NULL, 10);
+        }
+    }
+    while(0); /* break handling */
+    free(range);
+
+    /* sanity check: begin <= end */
+    if (conn->range_begin_given && conn->range_end_given &&
+        (conn->range_begin > conn->range_end))
+    {
+        conn->range_begin_given = conn->range_end_given = 0;
+    }
+}
+
+static int old_parse_request(struct old_conn *conn)
+{
+    size_t bound1, bound2;
+    char *tmp;
+    assert(conn->request_length == strlen(conn->request));
+
+    /* parse method */
+    for (bound1 = 0; bound1 < conn->request_length &&
+        conn->request[bound1] != ' '; bound1++)
+            ;
+
+    conn->method = split_string(conn->request, 0, bound1);
+    strntoupper(conn->method, bound1);
+
+    /* parse uri */
+    for (; bound1 < conn->request_length &&
+        conn->request[bound1] == ' '; bound1++)
+            ;
+
+    if (bound1 == conn->request_length) return 0; /* fail */
+
+    for (bound2=bound1+1; bound2 < conn->request_length &&
+        conn->request[bound2] != ' ' &&
+        conn->request[bound2] != '\r'; bound2++)
+            ;
+
+    conn->uri = split_string(conn->request, bound1, bound2);
+
+    /* parse protocol to determine conn_close */
+    if (conn->request[bound2] == ' ')
+    {
+        char *proto;
+        for (bound1 = bound2; bound1 < conn->request_length &&
+            conn->request[bound1] == ' '; bound1++)
+                ;
+
+        for (bound2=bound1+1; bound2 < conn->request_length &&
+            conn->request[bound2] != ' ' &&
+            conn->request[bound2] != '\r'; bound2++)
+                ;
+
+        proto = split_string(conn->request, bound1, bound2);
+        if (strcasecmp(proto, "HTTP/1.1") == 0) conn->conn_close = 0;
+        free(proto);
+    }
+
+    /* parse connection field */
+    tmp = old_parse_field(conn, "Connection: ");
+    if (tmp != NULL)
+    {
+        if (strcasecmp(tmp, "close") == 0) conn->conn_close = 1;
+        else if (strcasecmp(tmp, "keep-alive") == 0) conn->conn_close = 0;
+        free(tmp);
+    }
+
+    /* parse important fields */
+    conn->referer = old_parse_field(conn, "Referer: ");
+    conn->user_agent = old_parse_field(conn, "User-Agent: ");
+    old_parse_range_field(conn);
+    return 1;
+}
+
+
+
+static double elapsed_ns(const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 +
+        (end.tv_nsec - start->tv_nsec);
+}
+
+int main(void)
+{
+    const size_t len = sizeof(browser_request) - 1;
+    static char buf[sizeof(browser_request)];
+    static struct connection conn;
+    struct old_conn old;
+    struct timespec start;
+    double old_ns, new_ns;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i=0; i<ITERATIONS; i++)
+    {
+        memcpy(buf, browser_request, len + 1);
+        memset(&old, 0, sizeof(old));
+        old.request = buf;
+        old.request_length = len;
+        old.conn_close = 1;
+        if (!old_parse_request(&old)) errx(1, "old parser failed");
+        old.if_modified_since = old_parse_field(&old, "If-Modified-Since: ");
+        if (old.referer == NULL || old.user_agent == NULL ||
+            old.if_modified_since == NULL || !old.range_end_given)
+                errx(1, "old parser missed a field");
+        free(old.method);
+        free(old.uri);
+        free(old.referer);
+        free(old.user_agent);
+        free(old.if_modified_since);
+    }
+    old_ns = elapsed_ns(&start) / ITERATIONS;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i=0; i<ITERATIONS; i++)
+    {
+        memcpy(buf, browser_request, len + 1);
+        conn.request = buf;
+        conn.request_length = conn.request_end = len;
+        conn.num_headers = 0;
+        conn.num_ranges = 0;
+        conn.conn_close = 1;
+        if (!parse_request(&conn)) errx(1, "parser failed");
+        if (conn.referer == NULL || conn.user_agent == NULL ||
+            find_header(&conn, "If-Modified-Since") == NULL ||
+            conn.num_ranges != 1)
+                errx(1, "parser missed a field");
+        arena_reset(&conn.arena);
+    }
+    new_ns = elapsed_ns(&start) / ITERATIONS;
+    arena_free(&conn.arena);
+
+    printf("request parsing, %lu byte request, %d iterations:\n",
+        (unsigned long)len, ITERATIONS);
+    printf("  strstr() per field: %7.1f ns/request\n", old_ns);
+    printf("  header index:       %7.1f ns/request (%.1fx)\n",
+        new_ns, old_ns / new_ns);
+    return 0;
+}
+
+/* vim:set tabstop=4 shiftwidth=4 expandtab tw=78: */
@@ -0,0 +1,91 @@
+/* ---------------------------------------------------------------------------
+ * URI resolution benchmark: the single pass of resolve_uri() into the
+ * target buffer, against the baseline's urldecode(), make_safe_uri(), join
+ * with wwwroot and uri_content_type(), over the URIs of a typical page load.
+ *
+ *   $ make bench
+ */
+#define main shttpd_main
+#include "../shttpd.c"
+#undef main
+#include "old_uri.h"
+
+static const char *page_uris[] = {
+    "/",
+    "/articles/2026/10/some-article/",
+    "/static/css/site.css",
+    "/static/js/vendor/framework.min.js",
+    "/static/js/app.js",
+    "/static/fonts/inter-var-latin.woff2",
+    "/images/2026/10/header%20photo.jpg",
+    "/images/icons/../icons/share.svg",
+    "/favicon.ico",
+    "/robots.txt"
+};
+#define NUM_URIS (sizeof(page_uris) / sizeof(*page_uris))
+#define ITERATIONS 1000000
+
+static double elapsed_ns(const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 +
+        (end.tv_nsec - start->tv_nsec);
+}
+
+int main(void)
+{
+    static struct arena arena;
+    const char *root = "/var/www/htdocs", *type;
+    const size_t rootlen = strlen(root);
+    struct timespec start;
+    double old_ns, new_ns;
+    size_t checksum = 0, ext;
+    char *decoded, *target;
+    ssize_t len;
+    int i;
+
+    parse_default_extension_map();
+    sort_mime_map();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i=0; i<ITERATIONS; i++)
+    {
+        decoded = old_urldecode(page_uris[i % NUM_URIS]);
+        if (old_make_safe_uri(decoded) == NULL) errx(1, "old: rejected");
+        xasprintf(&target, "%s%s", root, decoded);
+        type = old_uri_content_type(target);
+        checksum += strlen(target) + strlen(type);
+        free(target);
+        free(decoded);
+    }
+    old_ns = elapsed_ns(&start) / ITERATIONS;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i=0; i<ITERATIONS; i++)
+    {
+        const char *uri = page_uris[i % NUM_URIS];
+
+        target = arena_alloc(&arena, rootlen + strlen(uri) + 1);
+        memcpy(target, root, rootlen);
+        len = resolve_uri(target + rootlen, uri, &ext);
+        if (len == -1) errx(1, "rejected");
+        type = (ext != 0) ? ext_content_type(target + rootlen + ext) :
+            default_mimetype;
+        checksum -= rootlen + len + strlen(type);
+        arena_reset(&arena);
+    }
+    new_ns = elapsed_ns(&start) / ITERATIONS;
+    arena_free(&arena);
+    if (checksum != 0) errx(1, "old and new resolved differently");
+
+    printf("URI resolution, %d URIs from a page load, %d iterations:\n",
+        (int)NUM_URIS, ITERATIONS);
+    printf("  decode, make safe, join: %7.1f ns/URI\n", old_ns);
+    printf("  resolve_uri():           %7.1f ns/URI (%.1fx)\n",
+        new_ns, old_ns / new_ns);
+    return 0;
+}
+
+/* vim:set tabstop=4 shiftwidth=4 expandtab tw=78: */
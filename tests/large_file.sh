@@ -0,0 +1,63 @@
+#!/bin/sh
+# ---------------------------------------------------------------------------
+# Large file test: serves a 10 GB sparse file and checks the length, a range
+# at the end, and a range across the 4 GB boundary, where 32-bit sizes and
+# offsets would wrap.  Marker strings are written at both places so that the
+# bytes, not just the headers, are checked.
+#
+#   $ make check
+#   $ tests/large_file.sh [./shttpd [port]]
+
+BIN=${1:-./shttpd}
+PORT=${2:-18090}
+SIZE=10737418240                # 10 GB
+EDGE=4294967290                 # 6 bytes short of 4 GB
+URL=http://127.0.0.1:$PORT/big.bin
+
+ROOT=`mktemp -d` || exit 1
+trap 'kill $PID 2>/dev/null; rm -rf "$ROOT"' EXIT
+if ! truncate -s $SIZE "$ROOT/big.bin" 2>/dev/null; then
+    echo "large_file.sh: can't make a sparse file here, skipped"
+    exit 0
+fi
+printf 'across-4GB-line!' | dd of="$ROOT/big.bin" bs=1 seek=$EDGE \
+    conv=notrunc 2>/dev/null
+printf 'the-end.\n' | dd of="$ROOT/big.bin" bs=1 seek=`expr $SIZE - 9` \
+    conv=notrunc 2>/dev/null
+
+$BIN "$ROOT" --port $PORT --addr 127.0.0.1 >/dev/null 2>&1 &
+PID=$!
+sleep 0.5
+
+fail=0
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL $1: got [$2], wanted [$3]"
+        fail=1
+    fi
+}
+header() {
+    curl -s -m 10 -o /dev/null -D - "$@" | tr -d '\r' | sed -n "s/^$H: //p"
+}
+
+H=Content-Length
+check "HEAD length" "`header -I $URL`" $SIZE
+
+check "end, body" "`curl -s -m 10 -r -9 $URL`" "the-end."
+H=Content-Range
+check "end, range" "`header -r -9 $URL`" \
+    "bytes `expr $SIZE - 9`-`expr $SIZE - 1`/$SIZE"
+
+check "4 GB, body" "`curl -s -m 10 -r $EDGE-4294967305 $URL`" \
+    "across-4GB-line!"
+check "4 GB, range" "`header -r $EDGE-4294967305 $URL`" \
+    "bytes $EDGE-4294967305/$SIZE"
+H=Content-Length
+check "4 GB, length" "`header -r $EDGE-4294967305 $URL`" 16
+
+check "past 4 GB, body" "`curl -s -m 10 -r 4294967296-4294967305 $URL`" \
+    "-4GB-line!"
+check "last byte, body" "`curl -s -m 10 -r \`expr $SIZE - 2\`- $URL`" "."
+
+if [ $fail = 0 ]; then echo "large_file.sh: 10 GB file OK"; fi
+exit $fail
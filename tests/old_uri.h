@@ -0,0 +1,174 @@
+/* ---------------------------------------------------------------------------
+ * The baseline's URI handling, from before resolve_uri(): urldecode(), then
+ * make_safe_uri() (with consolidate_slashes()), then a join with wwwroot and
+ * uri_content_type() on the result.  Kept here, as it was, for the
+ * differential test and the benchmark.  Include after shttpd.c.
+ */
+
+// Consolidate slashes in-place by shifting parts of the string over repeated slashes.
+static void old_consolidate_slashes(char *s)
+{
+    size_t left = 0, right = 0;
+    int saw_slash = 0;
+
+    assert(s != NULL);
+
+    while (s[right] != '\0')
+    {
+        if (saw_slash)
+        {
+            if (s[right] == '/') right++;
+            else
+            {
+                saw_slash = 0;
+                s[left++] = s[right++];
+            }
+        }
+        else
+        {
+            if (s[right] == '/') saw_slash++;
+            s[left++] = s[right++];
+        }
+    }
+    s[left] = '\0';
+}
+
+
+// Resolve /./ and /../ in a URI, in-place.  Returns NULL if the URI is
+//invalid/unsafe, or the original buffer if successful.
+static char *old_make_safe_uri(char *uri)
+{
+    struct {
+        char *start;
+        size_t len;
+    } *chunks;
+    unsigned int num_slashes, num_chunks;
+    size_t urilen, i, j, pos;
+    int ends_in_slash;
+
+    assert(uri != NULL);
+    if (uri[0] != '/') return NULL;
+    old_consolidate_slashes(uri);
+    urilen = strlen(uri);
+    if (urilen > 0)
+        ends_in_slash = (uri[urilen-1] == '/');
+    else
+        ends_in_slash = 1;
+
+    /* count the slashes */
+    for (i=0, num_slashes=0; i<urilen; i++)
+        if (uri[i] == '/') num_slashes++;
+
+    /* make an array for the URI elements */
+    chunks = xmalloc(sizeof(*chunks) * num_slashes);
+
+    /* split by slashes and build chunks array */
+    num_chunks = 0;
+    for (i=1; i<urilen;) {
+        /* look for the next slash */
+        for (j=i; j<urilen && uri[j] != '/'; j++)
+            ;
+
+        /* process uri[i,j) */
+        if ((j == i+1) && (uri[i] == '.'))
+            /* "." */;
+        else if ((j == i+2) && (uri[i] == '.') && (uri[i+1] == '.')) {
+            /* ".." */
+            if (num_chunks == 0) {
+                /* unsafe string so free chunks */
+                free(chunks);
+                return (NULL);
+            } else
+                num_chunks--;
+        } else {
+            chunks[num_chunks].start = uri+i;
+            chunks[num_chunks].len = j-i;
+            num_chunks++;
+        }
+
+        i = j + 1; /* uri[j] is a slash - move along one */
+    }
+
+    /* reassemble in-place */
+    pos = 0;
+    for (i=0; i<num_chunks; i++) {
+        assert(pos <= urilen);
+        uri[pos++] = '/';
+
+        assert(pos + chunks[i].len <= urilen);
+        assert(uri + pos <= chunks[i].start);
+
+        if (uri+pos < chunks[i].start)
+            memmove(uri+pos, chunks[i].start, chunks[i].len);
+        pos += chunks[i].len;
+    }
+    free(chunks);
+
+    if ((num_chunks == 0) || ends_in_slash) uri[pos++] = '/';
+    assert(pos <= urilen);
+    uri[pos] = '\0';
+    return uri;
+}
+
+static const char *old_uri_content_type(const char *uri) {
+    size_t period, urilen = strlen(uri);
+
+    for (period=urilen-1;
+        period > 0 &&
+        uri[period] != '.' &&
+        (urilen-period-1) <= longest_ext;
+        period--)
+            ;
+
+    if (uri[period] == '.')
+    {
+        struct mime_mapping *result =
+            bsearch((uri+period+1), mime_map, mime_map_size,
+            sizeof(struct mime_mapping), mime_mapping_cmp_str);
+
+        if (result != NULL)
+        {
+            assert(strcmp(uri+period+1, result->extension) == 0);
+            return result->mimetype;
+        }
+    }
+    /* else no period found in the string */
+    return default_mimetype;
+}
+
+/* ---------------------------------------------------------------------------
+ * Decode URL by converting %XX (where XX are hexadecimal digits) to the
+ * character it represents.  Don't forget to free the return value.
+ */
+static char *old_urldecode(const char *url)
+{
+    size_t i, len = strlen(url);
+    char *out = xmalloc(len+1);
+    int pos;
+
+    for (i=0, pos=0; i<len; i++)
+    {
+        if (url[i] == '%' && i+2 < len &&
+            isxdigit(url[i+1]) && isxdigit(url[i+2]))
+        {
+            /* decode %XX */
+            #define HEX_TO_DIGIT(hex) ( \
+                ((hex) >= 'A' && (hex) <= 'F') ? ((hex)-'A'+10): \
+                ((hex) >= 'a' && (hex) <= 'f') ? ((hex)-'a'+10): \
+                ((hex)-'0') )
+
+            out[pos++] = HEX_TO_DIGIT(url[i+1]) * 16 +
+                         HEX_TO_DIGIT(url[i+2]);
+            i += 2;
+
+            #undef HEX_TO_DIGIT
+        }
+        else
+        {
+            /* straight copy */
+            out[pos++] = url[i];
+        }
+    }
+    out[pos] = '\0';
+    return (out);
+}
@@ -0,0 +1,133 @@
+/* ---------------------------------------------------------------------------
+ * Differential test: resolve_uri() against the baseline's urldecode() and
+ * make_safe_uri(), on random URIs built from the pieces that matter to path
+ * resolution - slashes, dots, escapes of both, and bad escapes.  Both must
+ * reject the same URIs, and otherwise give the same path and content type.
+ *
+ * The one deliberate difference: resolve_uri() rejects an escaped NUL, which
+ * the old code silently truncated the path at, so those only have to be
+ * rejected.
+ *
+ *   $ make check
+ *   $ tests/resolve_uri_diff [count [seed]]
+ */
+#define main shttpd_main
+#include "../shttpd.c"
+#undef main
+#include "old_uri.h"
+
+static const char *pieces[] = {
+    "/", "/", "/", "//", ".", ".", "..", "...", "a", "bc", "d.e",
+    "index.html", "x.gz", ".htaccess", "%2e", "%2E", "%2e%2e", "%2f",
+    "%2F", "%5c", "%41", "%7e", "%ff", "%00", "%", "%2", "%g1", "%%",
+    "?", "#", " "
+};
+#define NUM_PIECES (sizeof(pieces) / sizeof(*pieces))
+#define MAX_PIECES 12
+
+static uint64_t rng_state;
+
+static uint32_t rng(void)
+{
+    /* xorshift64*, so runs are repeatable from the seed */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+static void random_uri(char *uri)
+{
+    const int n = rng() % (MAX_PIECES + 1);
+    int i;
+
+    /* nearly always absolute, like a real request */
+    strcpy(uri, (rng() % 16 == 0) ? "" : "/");
+    for (i=0; i<n; i++)
+        strcat(uri, pieces[rng() % NUM_PIECES]);
+}
+
+/* Returns 0 if both agree on [uri]. */
+static int compare(const char *uri)
+{
+    char out[MAX_PIECES * 10 + 2], *old;
+    const char *old_type, *new_type;
+    ssize_t len;
+    size_t ext;
+    int same;
+
+    len = resolve_uri(out, uri, &ext);
+    if (strstr(uri, "%00") != NULL)
+    {
+        if (len == -1) return 0;
+        printf("FAIL: %s\n  escaped NUL not rejected: %s\n", uri, out);
+        return 1;
+    }
+
+    old = old_urldecode(uri);
+    if (old_make_safe_uri(old) == NULL)
+    {
+        free(old);
+        if (len == -1) return 0;
+        printf("FAIL: %s\n  old: rejected\n  new: %s\n", uri, out);
+        return 1;
+    }
+    if (len == -1)
+    {
+        printf("FAIL: %s\n  old: %s\n  new: rejected\n", uri, old);
+        free(old);
+        return 1;
+    }
+
+    same = (strcmp(old, out) == 0 && (size_t)len == strlen(out));
+    if (same && out[len-1] != '/')
+    {
+        old_type = old_uri_content_type(old);
+        new_type = (ext != 0) ? ext_content_type(out + ext) :
+            default_mimetype;
+        same = (strcmp(old_type, new_type) == 0);
+    }
+    if (!same)
+        printf("FAIL: %s\n  old: %s\n  new: %s (ext at %lu)\n",
+            uri, old, out, (unsigned long)ext);
+    free(old);
+    return !same;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *fixed[] = {
+        "/", "//", "/.", "/..", "/./", "/../", "/a/..", "/a/../..",
+        "/a/./b/../c/", "/%2e%2e/etc/passwd", "/a/%2e%2e/%2e%2e/x",
+        "/a%2f..%2f..%2fx", "/index.html", "/a.b/c", "/x.tar.gz",
+        "/%00", "/a%00.html", "", "a", "%2fa", "/%", "/%4", "/%41"
+    };
+    const unsigned long count = (argc > 1) ? strtoul(argv[1], NULL, 10) :
+        1000000;
+    char uri[MAX_PIECES * 10 + 2];
+    unsigned long i, failures = 0;
+    size_t f;
+
+    rng_state = (argc > 2) ? strtoull(argv[2], NULL, 10) : 20261018;
+    if (rng_state == 0) rng_state = 1;
+    parse_default_extension_map();
+    sort_mime_map();
+
+    for (f=0; f<sizeof(fixed)/sizeof(*fixed); f++)
+        failures += compare(fixed[f]);
+    for (i=0; i<count && failures < 20; i++)
+    {
+        random_uri(uri);
+        failures += compare(uri);
+    }
+
+    if (failures > 0)
+    {
+        printf("resolve_uri: %lu differences\n", failures);
+        return 1;
+    }
+    printf("resolve_uri: %lu random URIs, no differences\n", count);
+    return 0;
+}
+
+/* vim:set tabstop=4 shiftwidth=4 expandtab tw=78: */
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+# ---------------------------------------------------------------------------
+# Segment count benchmark: how many TCP segments the server sends per reply,
+# over keep-alive connections on loopback, read from the client socket's
+# TCP_INFO (tcpi_segs_in, Linux 4.2 and up).  A header sent apart from its
+# body shows up as two segments where one would do.
+#
+#   $ make bench
+#   $ tests/segments.py ./shttpd /path/to/older/shttpd
+#
+# Give more than one binary to compare them side by side.
+
+import os, socket, struct, subprocess, sys, tempfile, time
+
+REQUESTS = 200
+CASES = [
+    ("404, generated", "missing.html", None),
+    ("1 KB file", "small.html", 1000),
+    ("12 KB file", "medium.css", 12000),
+    ("200 KB file", "large.js", 200000),
+]
+TCPI_SEGS_IN = 140  # offset in struct tcp_info
+
+
+def segs_in(sock):
+    info = sock.getsockopt(socket.IPPROTO_TCP, socket.TCP_INFO, 256)
+    if len(info) < TCPI_SEGS_IN + 4:
+        sys.exit("segments.py: TCP_INFO has no tcpi_segs_in here")
+    return struct.unpack_from("I", info, TCPI_SEGS_IN)[0]
+
+
+def read_reply(sock):
+    data = b""
+    while b"\r\n\r\n" not in data:
+        chunk = sock.recv(65536)
+        if not chunk:
+            sys.exit("segments.py: connection closed mid-reply")
+        data += chunk
+    header, body = data.split(b"\r\n\r\n", 1)
+    length = 0
+    for line in header.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        if name.lower() == b"content-length":
+            length = int(value)
+    while len(body) < length:
+        chunk = sock.recv(65536)
+        if not chunk:
+            sys.exit("segments.py: connection closed mid-body")
+        body += chunk
+
+
+def segments_per_reply(port, name):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    request = ("GET /%s HTTP/1.1\r\nHost: localhost\r\n\r\n" % name).encode()
+    before = segs_in(sock)
+    for _ in range(REQUESTS):
+        sock.sendall(request)
+        read_reply(sock)
+    after = segs_in(sock)
+    sock.close()
+    return (after - before) / REQUESTS
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def measure(binary, root):
+    port = free_port()
+    server = subprocess.Popen([binary, root, "--port", str(port),
+        "--addr", "127.0.0.1"], stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            try:
+                socket.create_connection(("127.0.0.1", port)).close()
+                break
+            except ConnectionRefusedError:
+                time.sleep(0.02)
+        return [segments_per_reply(port, name) for _, name, _ in CASES]
+    finally:
+        server.terminate()
+        server.wait()
+
+
+def main():
+    binaries = sys.argv[1:] or ["./shttpd"]
+    with tempfile.TemporaryDirectory() as root:
+        for _, name, size in CASES:
+            if size is not None:
+                with open(os.path.join(root, name), "wb") as f:
+                    f.write(b"x" * size)
+        results = [measure(os.path.abspath(b), root) for b in binaries]
+
+    print("TCP segments per keep-alive reply, %d requests each:" % REQUESTS)
+    print("  %-16s" % "" + "".join("%14s" % os.path.basename(b)[-14:]
+        for b in binaries))
+    for i, (label, _, _) in enumerate(CASES):
+        print("  %-16s" % label + "".join("%14.2f" % r[i] for r in results))
+
+
+if __name__ == "__main__":
+    main()
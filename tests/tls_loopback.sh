@@ -0,0 +1,84 @@
+#!/bin/sh
+# ---------------------------------------------------------------------------
+# HTTPS test over loopback, for a shttpd built with make TLS=1: a body bigger
+# than a TLS record, sent with SSL_write() rather than kTLS; a session
+# resumed from a ticket saved on an earlier connection; and a multipart range
+# reply.  The certificate is a throwaway self-signed one.
+#
+#   $ make check TLS=1
+#   $ tests/tls_loopback.sh [./shttpd [port]]
+
+BIN=${1:-./shttpd}
+PORT=${2:-18443}
+URL=https://127.0.0.1:$PORT
+
+if ! $BIN --help 2>&1 | grep -q -- --tls-cert; then
+    echo "tls_loopback.sh: $BIN was built without TLS, skipped"
+    exit 0
+fi
+
+ROOT=`mktemp -d` || exit 1
+trap 'kill $PID 2>/dev/null; rm -rf "$ROOT"' EXIT
+mkdir "$ROOT/www"
+if ! openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+    -keyout "$ROOT/key.pem" -out "$ROOT/cert.pem" >/dev/null 2>&1; then
+    echo "tls_loopback.sh: can't make a certificate, skipped"
+    exit 0
+fi
+# one file kept in memory and one sent from its fd, both several records
+seq 1 8000 > "$ROOT/www/small.txt"
+seq 1 30000 > "$ROOT/www/large.bin"
+SIZE=`wc -c < "$ROOT/www/large.bin" | tr -d ' '`
+
+$BIN "$ROOT/www" --port $PORT --addr 127.0.0.1 \
+    --tls-cert "$ROOT/cert.pem" --tls-key "$ROOT/key.pem" >/dev/null 2>&1 &
+PID=$!
+sleep 0.5
+
+fail=0
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL $1: got [$2], wanted [$3]"
+        fail=1
+    fi
+}
+
+# the kernel can't do CBC ciphers, so these always go through SSL_write()
+for f in small.txt large.bin; do
+    curl -sk -m 10 --tls-max 1.2 --ciphers ECDHE-RSA-AES128-SHA256 \
+        -o "$ROOT/got" $URL/$f
+    if cmp -s "$ROOT/got" "$ROOT/www/$f"; then same=yes; else same=no; fi
+    check "SSL_write() body, $f" $same yes
+done
+
+# a ticket saved from one connection resumes the next
+REQUEST='GET /small.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n'
+printf "$REQUEST" | openssl s_client -connect 127.0.0.1:$PORT -ign_eof \
+    -sess_out "$ROOT/session" >/dev/null 2>&1
+check "resumption" "`printf \"$REQUEST\" | openssl s_client -ign_eof \
+    -connect 127.0.0.1:$PORT -sess_in \"$ROOT/session\" 2>/dev/null |
+    sed -n 's/^\(Reused\|New\),.*/\1/p' | head -1`" Reused
+
+# multipart/byteranges, compared byte for byte
+TYPE=`curl -skI -m 10 $URL/large.bin | tr -d '\r' | \
+    sed -n 's/^Content-Type: //p'`
+curl -sk -m 10 -r 0-9,100000-100099,`expr $SIZE - 5`- -D "$ROOT/header" \
+    -o "$ROOT/got" $URL/large.bin
+B=`tr -d '\r' < "$ROOT/header" | sed -n 's/.*boundary=//p'`
+part() {
+    printf '\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %s-%s/%s\r\n\r\n' \
+        "$B" "$TYPE" $1 $2 $SIZE
+    dd if="$ROOT/www/large.bin" bs=1 skip=$1 count=`expr $2 - $1 + 1` \
+        2>/dev/null
+}
+{
+    part 0 9
+    part 100000 100099
+    part `expr $SIZE - 5` `expr $SIZE - 1`
+    printf '\r\n--%s--\r\n' "$B"
+} > "$ROOT/want"
+if cmp -s "$ROOT/got" "$ROOT/want"; then same=yes; else same=no; fi
+check "multipart ranges" $same yes
+
+if [ $fail = 0 ]; then echo "tls_loopback.sh: HTTPS OK"; fi
+exit $fail